@@ -1,10 +1,17 @@
 #include <algorithm>
+#include <cctype>
 #include <chrono>
+#include <cstring>
+#include <csignal>
 #include <execution>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <numeric>
 #include <regex>
 #include <tuple>
 #include <unordered_map>
@@ -18,280 +25,196 @@
 #include <stdio.h>
 #include <errno.h>
 
+#include "bench.h"
+#include "binresult.h"
 #include "cmdline.h"
+#include "content.h"
+#include "fileid.h"
+#include "metrics.h"
+#include "mounts.h"
+#include "output.h"
+#include "pipeline.h"
+#include "progress.h"
+#include "scanner.h"
+#include "spill.h"
+#include "types.h"
+#include "watch.h"
 
 
-namespace fs = std::filesystem;
 using std::chrono::high_resolution_clock;
 using std::chrono::duration_cast;
 using std::chrono::duration;
 using std::chrono::milliseconds;
 
+static std::string ALL_FILES("*.*");
 
-using PathSize = std::pair<fs::path, uint64_t>;
-using PathSizeIdx = std::pair<uint64_t, size_t>;
-using PathVec  = std::vector<fs::path>;
-using IndexVec = std::vector<size_t>;
-using PathSizeIdxVec = std::vector<PathSizeIdx>;
-
-using DuplicateFilesNames = std::unordered_map<std::string, IndexVec>;
-using DuplicateFilesSizes = std::unordered_map<uint64_t, uint32_t>;
-using DuplicateFilesHash  = std::unordered_map<uint64_t, uint32_t>;
 
-using MemBuffer512  = std::array<char, 512>;
-using FileMemBuffer = std::vector<std::byte>;
-using SHA2Hash      = std::array<uint8_t, 32>;
 
-static std::string ALL_FILES("*.*");
-
-namespace
+//--------------------------------------------------------------------------------------------
+// scan options (scanner.h) plus what only the command line front end needs
+struct Options : ScanOptions
 {
-    struct PathDetails
-    {
-        fs::path m_path{};
-        uint64_t m_size{};
-    };
+    OutputFormat Format{ OutputFormat::Text };
+    std::string OutBinFile{};
+    std::string InBinFile{};
+    std::vector<std::string> MergeInputs{};     // merge: the --shard partials
+    std::string WatchSocket{};
+    std::string BenchDir{};
+    std::string BenchSpecStr{};
+    std::string StatsJsonFile{};
+    bool PrintStats{ false };
+    bool IdleIo{ false };
+    bool Merge{ false };
+    bool Progress{ false };
+    bool Verbose{ false };
+    bool NoBanner{ false };
 
-    struct NameBasedGroup
+    static Options WithDefaults()
     {
-        IndexVec m_duplicates{};
-        uint64_t m_totalSize{0U};
-    };
-}
+        Options opts{};
 
-using PathDetailsVec = std::vector<PathDetails>;
-using NameBasedGroupVec = std::vector<NameBasedGroup>;
+        opts.Directory = ".";
+        opts.Pattern = "*";
+        opts.GroupingMethod = Method::NameSize;
 
-// https://raw.githubusercontent.com/p-ranav/glob/master/single_include/glob/glob.hpp
-namespace
-{
-    static inline bool string_replace(std::string& str, const std::string& from, const std::string& to)
-    {
-        std::size_t start_pos = str.find(from);
-        if (start_pos == std::string::npos)
-            return false;
-        str.replace(start_pos, from.length(), to);
-        return true;
+        return opts;
     }
 
-    static inline std::string translate(const std::string & pattern)
+    static Method FromString(const std::string& str)
     {
-        std::size_t i = 0, n = pattern.size();
-        std::string result_string;
-
-        while (i < n)
-        {
-            auto c = pattern[i];
-            i += 1;
-            if (c == '*')
-            {
-                result_string += ".*";
-            }
-            else if (c == '?')
-            {
-                result_string += ".";
-            }
-            else if (c == '[')
-            {
-                auto j = i;
+        if (str == "n")
+            return Method::Name;
+        else if (str == "ns")
+            return Method::NameSize;
+        else if (str == "nsc")
+            return Method::NameSizeContent;
+        else
+            return Method::NameSize;
+    }
 
-                if (j < n && pattern[j] == '!')
-                    j += 1;
+private:
+    Options() = default;
+};
 
-                if (j < n && pattern[j] == ']')
-                    j += 1;
 
-                while (j < n && pattern[j] != ']')
-                    j += 1;
 
-                if (j >= n)
-                {
-                    result_string += "\\[";
-                }
-                else
-                {
-                    auto stuff = std::string(pattern.begin() + i, pattern.begin() + j);
-                    if (stuff.find("--") == std::string::npos)
-                    {
-                        string_replace(stuff, std::string{ "\\" }, std::string{ R"(\\)" });
-                    }
-                    else
-                    {
-                        std::vector<std::string> chunks;
-                        std::size_t k = 0;
-                        if (pattern[i] == '!')
-                            k = i + 2;
-                        else
-                            k = i + 1;
-
-                        while (true)
-                        {
-                            k = pattern.find("-", k, j);
-                            if (k == std::string::npos)
-                                break;
-
-                            chunks.push_back(std::string(pattern.begin() + i, pattern.begin() + k));
-                            i = k + 1;
-                            k = k + 3;
-                        }
-
-                        chunks.push_back(std::string(pattern.begin() + i, pattern.begin() + j));
-                        // Escape backslashes and hyphens for set difference (--).
-                        // Hyphens that create ranges shouldn't be escaped.
-                        bool first = false;
-                        for (auto& s : chunks)
-                        {
-                            string_replace(s, std::string{ "\\" }, std::string{ R"(\\)" });
-                            string_replace(s, std::string{ "-" }, std::string{ R"(\-)" });
-                            if (first)
-                            {
-                                stuff += s;
-                                first = false;
-                            }
-                            else
-                            {
-                                stuff += "-" + s;
-                            }
-                        }
-                    }
-
-                    // Escape set operations (&&, ~~ and ||).
-                    std::string result;
-                    std::regex_replace(std::back_inserter(result),          // result
-                        stuff.begin(), stuff.end(),          // string
-                        std::regex(std::string{ R"([&~|])" }), // pattern
-                        std::string{ R"(\\\1)" });             // repl
-                    stuff = result;
-                    i = j + 1;
-
-                    if (stuff[0] == '!')
-                        stuff = "^" + std::string(stuff.begin() + 1, stuff.end());
-                    else if (stuff[0] == '^' || stuff[0] == '[')
-                        stuff = "\\\\" + stuff;
-
-                    result_string = result_string + "[" + stuff + "]";
-                }
-            }
-            else
-            {
-                // SPECIAL_CHARS
-                // closing ')', '}' and ']'
-                // '-' (a range in character set)
-                // '&', '~', (extended character set operations)
-                // '#' (comment) and WHITESPACE (ignored) in verbose mode
-                static std::string special_characters = "()[]{}?*+-|^$\\.&~# \t\n\r\v\f";
-                static std::map<int, std::string> special_characters_map;
-                if (special_characters_map.empty())
-                {
-                    for (auto& c : special_characters)
-                    {
-                        special_characters_map.insert(
-                            std::make_pair(static_cast<int>(c), std::string{ "\\" } +std::string(1, c)));
-                    }
-                }
-
-                if (special_characters.find(c) != std::string::npos)
-                    result_string += special_characters_map[static_cast<int>(c)];
-                else
-                    result_string += c;
+//--------------------------------------------------------------------------------------------
+// plain byte counts or with a K/M/G/T suffix (powers of 1024), e.g. 4096, 64K, 10M
+static bool parseSize(const std::string& str, uint64_t& value)
+{
+    if (str.empty() || !std::isdigit(static_cast<unsigned char>(str[0])))
+        return false;
 
-            }
-        }
-        return std::string{ "((" } +result_string + std::string{ R"()|[\r\n])$)" };
+    size_t pos = 0;
+    unsigned long long number = 0;
+    try
+    {
+        number = std::stoull(str, &pos);
     }
-
-    static inline std::regex compile_pattern(const std::string & pattern)
+    catch (std::exception&)
     {
-        return std::regex(pattern, std::regex::ECMAScript | std::regex::icase);
+        return false;
     }
 
-    static inline bool fnmatch_case(const fs::path & name, const std::regex & pattern)
+    unsigned shift = 0;
+    if (pos < str.size())
     {
-        bool res = false;
-        try
-        {
-            res = std::regex_match(name.string(), pattern);
-        }
-        catch (std::exception&)
+        switch (std::toupper(static_cast<unsigned char>(str[pos])))
         {
-            res = false;
+        case 'K': shift = 10; break;
+        case 'M': shift = 20; break;
+        case 'G': shift = 30; break;
+        case 'T': shift = 40; break;
+        default:  return false;
         }
-        return res;
-    }
-
-    static inline bool fnmatch_case(const fs::path& name, const std::string & pattern)
-    {
-        return std::regex_match(name.string(), compile_pattern(pattern));
+        if (++pos != str.size())
+            return false;
     }
 
-    static inline PathVec filter(const PathVec & names, const std::regex & pattern)
-    {
-        // std::cout << "Pattern: " << pattern << "\n";
-        PathVec result;
-        for (auto& name : names)
-        {
-            // std::cout << "Checking for " << name.string() << "\n";
-            if (fnmatch_case(name, pattern))
-                result.push_back(name);
+    if (shift != 0 && number > (UINT64_MAX >> shift))
+        return false;
 
-        }
-        return result;
-    }
+    value = static_cast<uint64_t>(number) << shift;
+    return true;
 }
 
+// a plain count of MiB, e.g. --max-read-mbps 200, as bytes; a suffix would scale it twice
+static bool parseMiB(const std::string& str, uint64_t& bytes)
+{
+    uint64_t mib = 0;
+    if (!std::all_of(std::begin(str), std::end(str), [](unsigned char c) { return std::isdigit(c) != 0; }) ||
+        !parseSize(str, mib) || mib > (UINT64_MAX >> 20))
+        return false;
 
+    bytes = mib << 20;
+    return true;
+}
 
-//--------------------------------------------------------------------------------------------
-struct Options
+// cmdline reader which rejects anything parseSize doesn't understand
+struct size_reader
 {
-    enum class Method
+    std::string operator()(const std::string& str) const
     {
-        Name,
-        NameSize,
-        NameSizeContent
-    };
-
-    std::string Directory{};
-    std::string Pattern{};
-    std::string SkipPattern{};
-    Method GroupingMethod{ Method::NameSize};
-    bool Verbose{ false };
-    bool NoBanner{ false };
+        uint64_t ignored = 0;
+        if (!parseSize(str, ignored))
+            throw cmdline::cmdline_error("invalid size " + str);
+        return str;
+    }
+};
 
-    static Options WithDefaults()
+struct mib_reader
+{
+    std::string operator()(const std::string& str) const
     {
-        Options opts{};
-
-        opts.Directory = ".";
-        opts.Pattern = "*";
-        opts.GroupingMethod = Method::NameSize;
-
-        return opts;
+        uint64_t ignored = 0;
+        if (!parseMiB(str, ignored))
+            throw cmdline::cmdline_error("invalid MiB count " + str + ", expected a plain number");
+        return str;
     }
+};
 
-    static Method FromString(const std::string& str)
+// cmdline reader for --io-threads
+struct device_limits_reader
+{
+    std::string operator()(const std::string& str) const
     {
-        if (str == "n")
-            return Method::Name;
-        else if (str == "ns")
-            return Method::NameSize;
-        else if (str == "nsc")
-            return Method::NameSizeContent;
-        else
-            return Method::NameSize;
+        DeviceLimits ignored = DeviceLimits::Defaults();
+        std::string error{};
+        if (!parseDeviceLimits(str, ignored, error))
+            throw cmdline::cmdline_error(error);
+        return str;
     }
-
-private:
-    Options() = default;
 };
 
+// cmdline reader for --shard
+struct shard_reader
+{
+    std::string operator()(const std::string& str) const
+    {
+        uint32_t index = 0;
+        uint32_t count = 0;
+        if (!parseShard(str, index, count))
+            throw cmdline::cmdline_error("invalid shard " + str + ", expected i/N with i < N");
+        return str;
+    }
+};
 
 //--------------------------------------------------------------------------------------------
 static Options getCmdOptions(int argc, char* argv[])
 {
     cmdline::parser cmdParser;
 
-    cmdParser.set_program_name("lsdups.exe");
+    // "lsdups merge [options] partials..." parses the same options, minus the subcommand
+    const bool merge = argc > 1 && std::strcmp(argv[1], "merge") == 0;
+    if (merge)
+    {
+        --argc;
+        ++argv;
+    }
+
+    cmdParser.set_program_name(merge ? "lsdups.exe merge" : "lsdups.exe");
+    cmdParser.footer(merge ? "<--shard --out-bin files>..."
+                           : "\n       lsdups.exe merge [options] <--shard --out-bin files>...");
 
     std::string DEFAULT_STRING_VALUE("");
     bool MANDATORY_ARG = true;
@@ -299,7 +222,8 @@ static Options getCmdOptions(int argc, char* argv[])
     bool DEFAULT_BOOL_VALUE_TRUE = true;
     bool DEFAULT_BOOL_VALUE_FALSE = false;
 
-    cmdParser.add<std::string>("dir", 'd',     "directory to analyze (defaults to current directory)", OPTIONAL_ARG, DEFAULT_STRING_VALUE);
+    cmdParser.add<std::string>("dir", 'd',     "directories to analyze, separated like PATH entries (defaults to current directory)", OPTIONAL_ARG, DEFAULT_STRING_VALUE);
+    cmdParser.add<std::string>("ref", '\0',    "reference directories, only report -d files which already exist under one of these", OPTIONAL_ARG, DEFAULT_STRING_VALUE);
     cmdParser.add<std::string>("pattern", 'p', "pattern for files to find (defaults to *.*)", OPTIONAL_ARG, "*.*");
     cmdParser.add<std::string>("skip", '\0',   "pattern for files to skip", OPTIONAL_ARG, DEFAULT_STRING_VALUE);
 
@@ -307,12 +231,63 @@ static Options getCmdOptions(int argc, char* argv[])
     // Call add method without a type parameter.
     // cmdParser.add("name", '\0', "check name based duplicates");
     cmdParser.add<std::string>("method", '\0',
-        R"(method to group and analyze possible duplicates (not used). 
+        R"(method to group and analyze possible duplicates
              n   --> group only by name
              ns  --> group by name and then by size
              nsc --> group by name, size and then contents check)",
         OPTIONAL_ARG, "ns");
 
+    cmdParser.add<std::string>("format", '\0',
+        R"(output format for duplicate groups
+             text  --> human readable report, sorted by total size
+             jsonl --> one json object per group, streamed as groups are found;
+                       bytes of a path that aren't valid UTF-8 show as U+FFFD (null keeps them)
+             csv   --> group,size,path rows, streamed as groups are found
+             null  --> NUL terminated paths, empty record between groups)",
+        OPTIONAL_ARG, "text", cmdline::oneof<std::string>("text", "jsonl", "csv", "null"));
+
+    cmdParser.add<std::string>("out-bin", '\0', "also write groups to this file in the binary result format", OPTIONAL_ARG, DEFAULT_STRING_VALUE);
+    cmdParser.add<std::string>("in-bin", '\0',  "list groups from a binary result file instead of scanning, -p/--min-size/--min-total filter them", OPTIONAL_ARG, DEFAULT_STRING_VALUE);
+
+    cmdParser.add("one-file-system", 'x', "don't descend into directories on other filesystems than their -d root");
+    cmdParser.add("follow-symlinks", 'L', "descend into symlinked directories, every directory and file is still visited once");
+    cmdParser.add<std::string>("exclude-fstype", '\0', "comma separated filesystem types never to descend into, added to proc, sysfs and the other pseudo filesystems", OPTIONAL_ARG, DEFAULT_STRING_VALUE);
+
+    cmdParser.add<std::string>("min-size", '\0',  "ignore files smaller than this, accepts K/M/G suffixes", OPTIONAL_ARG, "0", size_reader{});
+    cmdParser.add<std::string>("min-total", '\0', "only report groups wasting at least this much in total", OPTIONAL_ARG, "0", size_reader{});
+    cmdParser.add<std::string>("top", '\0',       "only report the K groups with the largest total size (0 = all)", OPTIONAL_ARG, "0", size_reader{});
+    cmdParser.add("sorted", '\0', "write csv/jsonl in the same largest first order as text instead of streaming groups as found");
+
+    cmdParser.add<std::string>("mem-limit", '\0', "group through temporary files, holding roughly this much in memory (0 = all in memory)", OPTIONAL_ARG, "0", size_reader{});
+    cmdParser.add<std::string>("spill-dir", '\0', "directory for the --mem-limit and --two-pass temporary files (defaults to the system temp directory)", OPTIONAL_ARG, DEFAULT_STRING_VALUE);
+    cmdParser.add("huge-pages", '\0', "back the grouping arenas with transparent huge pages (linux)");
+    cmdParser.add("dirs", '\0', "report identical directories as one group each and leave the files below their copies out of the file groups");
+    cmdParser.add("two-pass", '\0', "walk twice, the first time only sketching keys, so files with a unique name/size are never stored");
+    cmdParser.add<std::string>("checkpoint", '\0', "journal progress to this file every few seconds, so an interrupted scan can be resumed", OPTIONAL_ARG, DEFAULT_STRING_VALUE);
+    cmdParser.add("resume", '\0', "continue the scan journaled in --checkpoint instead of starting over");
+    cmdParser.add<std::string>("shard", '\0', "only scan the files whose name hashes to shard i of N, e.g. 2/8; write each with --out-bin and combine them with merge", OPTIONAL_ARG, DEFAULT_STRING_VALUE, shard_reader{});
+
+    cmdParser.add<std::string>("io-threads", '\0', "content readers per device by kind, e.g. hdd=1,ssd=16,net=4,other=4 or one number for all", OPTIONAL_ARG, DEFAULT_STRING_VALUE, device_limits_reader{});
+    cmdParser.add<std::string>("cache-policy", '\0',
+        R"(what content reads leave in the page cache
+             keep   --> read normally
+             drop   --> sequential read-ahead, every chunk dropped from the cache once hashed
+             direct --> bypass the cache with O_DIRECT (falls back to drop where unsupported))",
+        OPTIONAL_ARG, "keep", cmdline::oneof<std::string>("keep", "drop", "direct"));
+    cmdParser.add<std::string>("max-read-mbps", '\0', "cap on content bytes read per second across all readers, in MiB (0 = unlimited)", OPTIONAL_ARG, "0", mib_reader{});
+    cmdParser.add<std::string>("max-iops", '\0',      "cap on directory opens, stats and reads per second across traversal and readers (0 = unlimited)", OPTIONAL_ARG, "0", size_reader{});
+    cmdParser.add("idle-io", '\0', "run in the idle I/O scheduling class, served only when the disk is otherwise idle (linux, bfq/cfq)");
+
+    cmdParser.add<std::string>("watch", '\0', "keep running, follow -d with inotify and answer queries on this unix socket", OPTIONAL_ARG, DEFAULT_STRING_VALUE);
+
+    cmdParser.add<std::string>("bench", '\0',      "generate a synthetic tree in this directory and benchmark every phase on it, json to stdout", OPTIONAL_ARG, DEFAULT_STRING_VALUE);
+    cmdParser.add<std::string>("bench-spec", '\0', "synthetic tree and run settings, e.g. depth=3,fanout=4,files=10000,dups=0.2,runs=5,cache=cold", OPTIONAL_ARG, DEFAULT_STRING_VALUE);
+
+    cmdParser.add("stats", '\0', "print per phase counters, rates, peak rss and thread utilization at the end");
+    cmdParser.add<std::string>("stats-json", '\0', "write the --stats counters as json to this file", OPTIONAL_ARG, DEFAULT_STRING_VALUE);
+
+    cmdParser.add("progress", '\0', "report files, dirs and bytes hashed per second on stderr while running");
+
     cmdParser.add("verbose", 'v', "debug prints");
     cmdParser.add("nobanner", '\0', "Suppresses banner printing (off by default)");
 
@@ -326,94 +301,88 @@ static Options getCmdOptions(int argc, char* argv[])
 
     if (cmdParser.exist("dir"))
         opts.Directory = cmdParser.get<std::string>("dir");
+    if (cmdParser.exist("ref"))
+        opts.RefDirectory = cmdParser.get<std::string>("ref");
     if (cmdParser.exist("pattern"))
         opts.Pattern = cmdParser.get<std::string>("pattern");
     if (cmdParser.exist("skip"))
         opts.SkipPattern = cmdParser.get<std::string>("skip");
     if (cmdParser.exist("method"))
         opts.GroupingMethod = Options::FromString(cmdParser.get<std::string>("method"));
-
-    opts.Verbose = cmdParser.exist("verbose");
-    opts.NoBanner = cmdParser.exist("nobanner");
-
-    return opts;
-}
-
-//-------------------------------------------------------------------------------------------------------
-namespace
-{
-    struct Stats
+    if (cmdParser.exist("format"))
+        opts.Format = outputFormatFromString(cmdParser.get<std::string>("format"));
+
+    if (cmdParser.exist("out-bin"))
+        opts.OutBinFile = cmdParser.get<std::string>("out-bin");
+    if (cmdParser.exist("in-bin"))
+        opts.InBinFile = cmdParser.get<std::string>("in-bin");
+
+    if (cmdParser.exist("exclude-fstype"))
+        opts.ExcludeFsTypes += "," + cmdParser.get<std::string>("exclude-fstype");
+    opts.OneFileSystem = cmdParser.exist("one-file-system");
+    opts.FollowSymlinks = cmdParser.exist("follow-symlinks");
+    opts.Sorted = cmdParser.exist("sorted");
+    opts.HugePages = cmdParser.exist("huge-pages");
+    opts.TwoPass = cmdParser.exist("two-pass");
+    opts.DirGroups = cmdParser.exist("dirs");
+    if (cmdParser.exist("checkpoint"))
+        opts.CheckpointFile = cmdParser.get<std::string>("checkpoint");
+    opts.Resume = cmdParser.exist("resume");
+    if (cmdParser.exist("shard"))
+        parseShard(cmdParser.get<std::string>("shard"), opts.ShardIndex, opts.ShardCount);
+    opts.Merge = merge;
+    if (merge)
+        opts.MergeInputs = cmdParser.rest();
+
+    if (cmdParser.exist("min-size"))
+        parseSize(cmdParser.get<std::string>("min-size"), opts.MinSize);
+    if (cmdParser.exist("min-total"))
+        parseSize(cmdParser.get<std::string>("min-total"), opts.MinTotal);
+    if (cmdParser.exist("top"))
     {
-        size_t numFiles{};
-        size_t numDirs{};
-        long long timeMilliSecs{};
-    };
-}
-
-//-------------------------------------------------------------------------------------------------------
-static PathDetailsVec getAllMatchingFiles(const std::string& directoryPath, const std::string& pattern, 
-                                          const std::string& skipPattern, bool verbose,
-                                          Stats& travStats)
-{
-    using rdir_iter = fs::recursive_directory_iterator;
-    using dir_entry = fs::directory_entry;
-
-    auto t1 = high_resolution_clock::now();
-    PathDetailsVec allFiles{};
-    allFiles.reserve(100);
-
-    std::string tweakedPattern = translate(pattern);
-    const auto regex = compile_pattern(tweakedPattern);
-
-    bool hasSkipPattern = !skipPattern.empty();
-    std::regex skipRegex{};
-    std::string tweakedSkipPattern{};
-
-    if (hasSkipPattern)
-    {
-        tweakedSkipPattern = translate(skipPattern);
-        skipRegex = compile_pattern(tweakedSkipPattern);
+        uint64_t topK = 0;
+        parseSize(cmdParser.get<std::string>("top"), topK);
+        opts.TopK = static_cast<size_t>(topK);
     }
 
-    if (verbose)
-    {
-        std::cout << "Input Pattern: " << pattern << std::endl;
-        std::cout << "Xlate Pattern: " << tweakedPattern << std::endl;
+    if (cmdParser.exist("mem-limit"))
+        parseSize(cmdParser.get<std::string>("mem-limit"), opts.MemLimit);
+    if (cmdParser.exist("spill-dir"))
+        opts.SpillDir = cmdParser.get<std::string>("spill-dir");
 
-        std::cout << "Skip Pattern:  " << skipPattern << std::endl;
-        std::cout << "Xlate Pattern: " << tweakedSkipPattern << std::endl;
-    }
-    
-    for (const dir_entry& dirEntry : rdir_iter(directoryPath, fs::directory_options::skip_permission_denied))
+    if (cmdParser.exist("io-threads"))
     {
-        try
-        {
-            if (dirEntry.is_regular_file())
-            {
-                ++travStats.numFiles;
-
-                const fs::path& path = dirEntry.path().filename();
-                if (fnmatch_case(path, regex))
-                {
-                    if(!hasSkipPattern || !fnmatch_case(path, skipRegex))
-                        allFiles.emplace_back(PathDetails{ dirEntry, dirEntry.file_size()});
-                }
-            }
-            else if (dirEntry.is_directory())
-            {
-                ++travStats.numDirs;
-            }
-        }
-        catch (std::exception&)
-        {
-        }
+        std::string ignored{};
+        parseDeviceLimits(cmdParser.get<std::string>("io-threads"), opts.IoThreads, ignored);
     }
-    auto t2 = high_resolution_clock::now();
-    travStats.timeMilliSecs = duration_cast<milliseconds>(t2 - t1).count();
+    if (cmdParser.exist("max-read-mbps"))
+        parseMiB(cmdParser.get<std::string>("max-read-mbps"), opts.MaxReadBytesPerSec);
+    if (cmdParser.exist("max-iops"))
+        parseSize(cmdParser.get<std::string>("max-iops"), opts.MaxIops);
+    opts.IdleIo = cmdParser.exist("idle-io");
+    if (cmdParser.exist("cache-policy"))
+        opts.ContentCache = cachePolicyFromString(cmdParser.get<std::string>("cache-policy"));
+
+    if (cmdParser.exist("watch"))
+        opts.WatchSocket = cmdParser.get<std::string>("watch");
+
+    if (cmdParser.exist("bench"))
+        opts.BenchDir = cmdParser.get<std::string>("bench");
+    if (cmdParser.exist("bench-spec"))
+        opts.BenchSpecStr = cmdParser.get<std::string>("bench-spec");
+
+    if (cmdParser.exist("stats-json"))
+        opts.StatsJsonFile = cmdParser.get<std::string>("stats-json");
+
+    opts.PrintStats = cmdParser.exist("stats");
+    opts.Progress = cmdParser.exist("progress");
+    opts.Verbose = cmdParser.exist("verbose");
+    opts.NoBanner = cmdParser.exist("nobanner");
 
-    return allFiles;
+    return opts;
 }
 
+
 //-------------------------------------------------------------------------------------------------------
 static void getAllFiles_r(const fs::directory_entry& dir, const std::regex& pattern, PathDetailsVec& output)
 {
@@ -449,111 +418,296 @@ static PathDetailsVec getAllFiles_2(const std::string& directoryPath, const std:
     return allFiles;
 }
 
+
 //-------------------------------------------------------------------------------------------------------
-static void addFileNameToMapping(const PathDetails& path, size_t idx, DuplicateFilesNames& fnMapping)
+static int listBinResult(const Options& opts)
 {
-    fs::path leafPath = path.m_path.filename();
-    std::string fileName(leafPath.c_str());
+    BinResultView view{};
+    std::string error{};
+    if (!view.open(opts.InBinFile, error))
+    {
+        std::cerr << opts.InBinFile << ": " << error << std::endl;
+        return 1;
+    }
+
+    const bool hasPattern = opts.Pattern != "*" && opts.Pattern != ALL_FILES;
+    const std::regex regex = compile_pattern(translate(opts.Pattern));
 
-    auto iter = fnMapping.find(fileName);
-    if (iter == fnMapping.end())
-        iter = fnMapping.insert(std::make_pair(fileName, IndexVec{})).first;
+    BufferedWriter out(stdout);
+    GroupWriter groupWriter(opts.Format, out);
+    groupWriter.writeHeader();
+
+    uint64_t totalRunningSize = 0;
+    uint64_t uniqRunningSize = 0;
+    for (size_t g = 0; g < view.groupCount(); ++g)
+    {
+        const BinGroupRecord& group = view.group(g);
+        const std::string_view name = view.groupName(group);
 
-    iter->second.emplace_back(idx);
+        if (group.fileSize < opts.MinSize || group.totalSize < opts.MinTotal)
+            continue;
+        if (hasPattern && !fnmatch_case(fs::path(name), regex))
+            continue;
+
+        totalRunningSize += group.totalSize;
+        uniqRunningSize += group.fileSize;
+
+        groupWriter.writeGroup(name, group.fileSize, view.memberCount(group), group.totalSize, group.hash,
+                               [&](size_t i) { return view.path(view.member(group, i)); });
+    }
+
+    groupWriter.writeSummary(totalRunningSize, uniqRunningSize);
+    out.flush();
+    return out.good() ? 0 : 1;
 }
 
 //-------------------------------------------------------------------------------------------------------
-static uint64_t getTotalSize(const IndexVec& indices, const PathDetailsVec& allFiles)
+// merge: every group lives entirely in the shard its name hashes to, and each shard verified
+// its own contents, so combining the partials is checking they belong together, filtering and
+// putting the groups into canonical order across shards.
+static int mergeShards(const Options& opts)
 {
-    uint64_t totalSize = 0U;
+    if (opts.MergeInputs.empty())
+    {
+        std::cerr << "merge: no partial results given" << std::endl;
+        return 1;
+    }
 
-    for (const auto& idx : indices)
-        totalSize += allFiles[idx].m_size;
+    std::vector<std::unique_ptr<BinResultView>> views{};
+    for (const std::string& input : opts.MergeInputs)
+    {
+        views.emplace_back(std::make_unique<BinResultView>());
+        std::string error{};
+        if (!views.back()->open(input, error))
+        {
+            std::cerr << input << ": " << error << std::endl;
+            return 1;
+        }
+    }
 
-    return totalSize;
-}
+    const uint32_t shardCount = views.front()->shardCount();
+    const uint64_t fingerprint = views.front()->fingerprint();
+    std::vector<std::string> shardFiles(shardCount);
+    for (size_t v = 0; v < views.size(); ++v)
+    {
+        const BinResultView& view = *views[v];
+        const std::string& input = opts.MergeInputs[v];
+        if (view.shardCount() == 0)
+        {
+            std::cerr << input << ": not written by a --shard scan" << std::endl;
+            return 1;
+        }
+        if (view.shardCount() != shardCount || view.fingerprint() != fingerprint || view.shardIndex() >= shardCount)
+        {
+            std::cerr << input << ": shard of a different scan than " << opts.MergeInputs.front() << std::endl;
+            return 1;
+        }
+        if (!shardFiles[view.shardIndex()].empty())
+        {
+            std::cerr << input << ": shard " << view.shardIndex() << "/" << shardCount
+                      << " already given as " << shardFiles[view.shardIndex()] << std::endl;
+            return 1;
+        }
+        shardFiles[view.shardIndex()] = input;
+    }
+    for (uint32_t i = 0; i < shardCount; ++i)
+    {
+        if (shardFiles[i].empty())
+        {
+            std::cerr << "merge: shard " << i << "/" << shardCount << " is missing" << std::endl;
+            return 1;
+        }
+    }
 
+    const bool hasPattern = opts.Pattern != "*" && opts.Pattern != ALL_FILES;
+    const std::regex regex = compile_pattern(translate(opts.Pattern));
 
-//-------------------------------------------------------------------------------------------------------
-static std::vector<PathSizeIdxVec> splitBasedOnSize(PathSizeIdxVec input)
-{
-    std::sort(std::begin(input), std::end(input), 
-        [](const PathSizeIdx& one, const PathSizeIdx& two)
+    struct MergedGroup
+    {
+        const BinResultView* view;
+        const BinGroupRecord* group;
+        std::string_view firstPath;
+    };
+
+    std::vector<MergedGroup> groups{};
+    for (const auto& view : views)
+    {
+        for (size_t g = 0; g < view->groupCount(); ++g)
         {
-            return one.first < two.first;
+            const BinGroupRecord& group = view->group(g);
+            if (view->memberCount(group) == 0 || group.fileSize < opts.MinSize || group.totalSize < opts.MinTotal)
+                continue;
+            if (hasPattern && !fnmatch_case(fs::path(view->groupName(group)), regex))
+                continue;
+            groups.emplace_back(MergedGroup{ view.get(), &group, view->path(view->member(group, 0)) });
+        }
+    }
+
+    // same order a single scan reports in, the shards' own --top cuts keep the global top K
+    std::sort(std::begin(groups), std::end(groups),
+        [](const MergedGroup& first, const MergedGroup& second)
+        {
+            if (first.group->totalSize != second.group->totalSize)
+                return first.group->totalSize > second.group->totalSize;
+            return first.firstPath < second.firstPath;
         });
+    if (opts.TopK != 0 && groups.size() > opts.TopK)
+        groups.resize(opts.TopK);
+
+    BinResultWriter binWriter{};
+    const bool writeBin = !opts.OutBinFile.empty();
+    if (writeBin && !binWriter.open(opts.OutBinFile))
+    {
+        std::cerr << "unable to create " << opts.OutBinFile << std::endl;
+        return 1;
+    }
 
-    std::vector<PathSizeIdxVec> splits{};
+    BufferedWriter out(stdout);
+    GroupWriter groupWriter(opts.Format, out);
+    groupWriter.writeHeader();
 
-    size_t cStart = 0, idx = 0;
-    for (; idx < input.size(); ++idx)
+    uint64_t totalRunningSize = 0;
+    uint64_t uniqRunningSize = 0;
+    for (const MergedGroup& merged : groups)
     {
-        if (input[cStart].first == input[idx].first)
-            continue;
+        const BinResultView& view = *merged.view;
+        const BinGroupRecord& group = *merged.group;
+        const size_t count = view.memberCount(group);
 
-        splits.emplace_back(&input[cStart], &input[idx]);
-        cStart = idx;
+        totalRunningSize += group.totalSize;
+        uniqRunningSize += group.fileSize;
+
+        groupWriter.writeGroup(view.groupName(group), group.fileSize, count, group.totalSize, group.hash,
+                               [&](size_t i) { return view.path(view.member(group, i)); });
+        if (writeBin)
+        {
+            binWriter.addGroup(group.fileSize, count, group.totalSize, group.hash,
+                [&](size_t i)
+                {
+                    const BinFileRecord& file = view.member(group, i);
+                    return std::make_pair(view.path(file), file.size);
+                });
+        }
     }
 
-    splits.emplace_back(std::begin(input) + cStart, std::end(input));
+    groupWriter.writeSummary(totalRunningSize, uniqRunningSize);
+    out.flush();
 
-    return splits;
+    if (writeBin && !binWriter.finish())
+    {
+        std::cerr << "failed writing " << opts.OutBinFile << std::endl;
+        return 1;
+    }
+    return out.good() ? 0 : 1;
 }
 
 //-------------------------------------------------------------------------------------------------------
-static NameBasedGroupVec filterAndGroupFiles(const PathDetailsVec& allFiles, long long& timeMilliSec)
+static double elapsedMs(high_resolution_clock::time_point since)
 {
-    auto t1 = high_resolution_clock::now();
-    DuplicateFilesNames fnMapping{};
+    return duration<double, std::milli>(high_resolution_clock::now() - since).count();
+}
 
-    for (size_t idx = 0; idx < allFiles.size(); ++idx)
+//-------------------------------------------------------------------------------------------------------
+// Runs the whole pipeline (content stages included, whatever --method says) on a generated tree
+// and reports per phase timings as json on stdout, progress goes to stderr.
+static int runBenchmark(const Options& opts)
+{
+    BenchSpec spec{};
+    std::string error{};
+    if (!parseBenchSpec(opts.BenchSpecStr, spec, error))
     {
-        const PathDetails& pd = allFiles[idx];
-        addFileNameToMapping(pd, idx, fnMapping);
+        std::cerr << "--bench-spec: " << error << std::endl;
+        return 1;
     }
 
-    NameBasedGroupVec grouping{};
-    grouping.reserve(fnMapping.size());
-
-    for (const auto& data : fnMapping)
+    BenchTreeGenerator generator(opts.BenchDir, spec);
+    if (!generator.run(std::cerr, error))
     {
-        if (data.second.size() > 1)
-        {
-            PathSizeIdxVec fileSizes{};
-            for (const auto& idx : data.second)
-                fileSizes.emplace_back(std::make_pair(allFiles[idx].m_size, idx));
+        std::cerr << "--bench: " << error << std::endl;
+        return 1;
+    }
 
-            std::vector<PathSizeIdxVec> splitPaths = splitBasedOnSize(fileSizes);
+    Options runOpts = opts;
+    runOpts.Directory = opts.BenchDir;
+    runOpts.Verbose = false;
+    if (runOpts.SkipPattern.empty())
+        runOpts.SkipPattern = BenchTreeGenerator::MARKER_FILE;
 
-            for (const PathSizeIdxVec& el : splitPaths)
-            {
-                if (el.size() > 1)
-                {
-                    IndexVec idxVec{};
-                    for (const auto& si : el)
-                        idxVec.emplace_back(si.second);
+#ifdef _WIN32
+    FILE* nullSink = std::fopen("NUL", "wb");
+#else
+    FILE* nullSink = std::fopen("/dev/null", "wb");
+#endif
 
-                    grouping.emplace_back(NameBasedGroup{ idxVec,  getTotalSize(idxVec, allFiles) });
-                }
-            }
+    std::vector<BenchRun> runs{};
+    for (uint32_t i = 0; i < spec.runs; ++i)
+    {
+        BenchRun run{};
+        if (spec.coldCache)
+            run.fullyCold = evictBenchTree(opts.BenchDir);
+
+        long long ignoredMs = 0;
+        ScanStats travStats{};
+
+        auto t = high_resolution_clock::now();
+        PathDetailsVec allFiles = getAllMatchingFiles(runOpts, travStats);
+        run.traverseMs = elapsedMs(t);
+        run.files = allFiles.size();
+
+        t = high_resolution_clock::now();
+        NameBasedGroupVec grouping = filterAndGroupFiles<NameSizeContentKeys>(allFiles, ignoredMs, opts.MinTotal, 0, 0);
+        run.groupMs = elapsedMs(t);
+        run.candidateGroups = grouping.size();
+
+        t = high_resolution_clock::now();
+        grouping = verifyContents(grouping, allFiles, opts.MinTotal, opts.TopK, 0, opts.IoThreads, opts.ContentCache,
+                                  ignoredMs);
+        run.contentMs = elapsedMs(t);
+        run.groups = grouping.size();
+
+        t = high_resolution_clock::now();
+        {
+            BufferedWriter out(nullSink);
+            GroupWriter groupWriter(OutputFormat::JsonLines, out);
+            for (const NameBasedGroup& ng : grouping)
+                groupWriter.writeGroup(ng, allFiles);
         }
+        run.outputMs = elapsedMs(t);
+
+        std::cerr << "run " << (i + 1) << "/" << spec.runs << ": " << run.files << " files, "
+                  << run.groups << " groups" << std::endl;
+        runs.emplace_back(run);
     }
 
-    std::sort(std::begin(grouping), std::end(grouping),
-        [](const NameBasedGroup& first, const NameBasedGroup& second) -> bool
-        {
-            return first.m_totalSize > second.m_totalSize;
-        });
-    
-    auto t2 = high_resolution_clock::now();
-    timeMilliSec = duration_cast<milliseconds>(t2 - t1).count();
-    return grouping;
+    if (nullSink != nullptr)
+        std::fclose(nullSink);
+
+    writeBenchReport(std::cout, spec, opts.BenchDir, runs);
+    return 0;
 }
 
 //-------------------------------------------------------------------------------------------------------
-static double toMB(uint64_t sizeInBytes)
+// --watch: index once, then follow the tree instead of exiting
+static int runWatch(const Options& opts)
 {
-    return sizeInBytes / 1024.0 / 1024.0;
+    const std::regex regex = compile_pattern(translate(opts.Pattern));
+    const bool hasSkipPattern = !opts.SkipPattern.empty();
+    const std::regex skipRegex = hasSkipPattern ? compile_pattern(translate(opts.SkipPattern)) : std::regex{};
+
+    WatchOptions watchOpts{};
+    watchOpts.scan = opts;
+    watchOpts.scan.ShardCount = 0;
+    watchOpts.scan.VerboseLog = nullptr;
+    watchOpts.socketPath = opts.WatchSocket;
+    watchOpts.verifyContent = opts.GroupingMethod == Options::Method::NameSizeContent;
+    watchOpts.format = opts.Format;
+    watchOpts.acceptName = [&](const fs::path& name)
+    {
+        return fnmatch_case(name, regex) && (!hasSkipPattern || !fnmatch_case(name, skipRegex));
+    };
+
+    WatchServer server(watchOpts);
+    return server.run(std::cerr);
 }
 
 //-------------------------------------------------------------------------------------------------------
@@ -561,76 +715,219 @@ int main(int argc, char* argv[])
 {
     Options opts = getCmdOptions(argc, argv);
 
+    // watch and bench read through the same throttle as a scan
+    g_ioThrottle.configure(opts.MaxReadBytesPerSec, opts.MaxIops);
+    if (opts.IdleIo && !setIdleIoPriority())
+        std::cerr << "--idle-io: I/O priority classes are not supported here, ignored" << std::endl;
+
+    if (opts.Merge)
+        return mergeShards(opts);
+    if (!opts.InBinFile.empty())
+        return listBinResult(opts);
+    if (!opts.BenchDir.empty())
+        return runBenchmark(opts);
+    if (!opts.WatchSocket.empty())
+        return runWatch(opts);
+
+    Metrics::ThreadScope mainThread(g_metrics, "main");
+
+    // machine readable formats own stdout, everything else goes to stderr
+    const bool isTextFormat = opts.Format == OutputFormat::Text;
+    std::ostream& log = isTextFormat ? std::cout : std::cerr;
+
     if (!opts.NoBanner)
     {
-        std::cout << std::endl;
-        std::cout << "Author: Sarang Baheti, c 2021" << std::endl;
-        std::cout << R"(Source: https://github.com/sarangbaheti/lsdups)" << std::endl;
-        std::cout << R"(usage:)" << std::endl;
-        std::cout << R"(   lsdups -d <dir> -p *asdf*.txt)" << std::endl << std::endl;
+        log << std::endl;
+        log << "Author: Sarang Baheti, c 2021" << std::endl;
+        log << R"(Source: https://github.com/sarangbaheti/lsdups)" << std::endl;
+        log << R"(usage:)" << std::endl;
+        log << R"(   lsdups -d <dir> -p *asdf*.txt)" << std::endl << std::endl;
     }
 
-    Stats travStas{};
-    PathDetailsVec allFiles = getAllMatchingFiles(opts.Directory, opts.Pattern, opts.SkipPattern, opts.Verbose, travStas);
-    std::cout << "Found " << allFiles.size() << " matching files" << std::endl;
-    std::cout << "(FilesTraversed: " << travStas.numFiles
-              << ", DirsTraversed: " << travStas.numDirs
-              << " in " << travStas.timeMilliSecs << " milli-seconds)" << std::endl;
+    ProgressReporter progress{};
+    if (opts.Progress)
+        progress.start();
+
+    BufferedWriter out(stdout);
+    GroupWriter groupWriter(opts.Format, out);
 
-    if (opts.Verbose)
+    BinResultWriter binWriter{};
+    const bool writeBin = !opts.OutBinFile.empty();
+    if (writeBin && !binWriter.open(opts.OutBinFile))
     {
-        std::cout << std::endl;
-        std::cout << "Printing matching files: #" << allFiles.size() << std::endl;
-        std::cout << "---------------------------------------" << std::endl;
-        for (const PathDetails& pd : allFiles)
-            std::cout << "Size: " << std::setw(12) << pd.m_size << "  " << pd.m_path << std::endl;
-        std::cout << std::endl << std::endl;
+        std::cerr << "unable to create " << opts.OutBinFile << std::endl;
+        return 1;
     }
+    if (opts.ShardCount != 0)
+        binWriter.setShard(opts.ShardIndex, opts.ShardCount, scanFingerprint(opts, false));
 
-    long long timeMilliSec = 0;
-    NameBasedGroupVec grouping = filterAndGroupFiles(allFiles, timeMilliSec);
-    std::cout << std::endl;
-    std::cout << "Found " << grouping.size() << " potential duplicates (" << timeMilliSec << " ms)" << std::endl;
+    // text is always written in canonical order, --sorted asks the same of csv/jsonl
+    ScanOptions scanOpts = opts;
+    scanOpts.Sorted = opts.Sorted || isTextFormat;
+    scanOpts.VerboseLog = opts.Verbose ? &std::cout : nullptr;
 
-    std::cout << std::endl;
-
-    uint64_t totalRunningSize = 0;
-    uint64_t uniqRunningSize = 0;
-    for (const NameBasedGroup& ng : grouping)
+    Scanner::Events events{};
+    events.onPhase = [&](Phase phase)
+    {
+        // collected groups follow once the status lines are done
+        if (phase == Phase::Output)
+            log << std::endl;
+        progress.setPhase(phase);
+    };
+    events.onTraversed = [&](const ScanStats& travStats, const PathDetailsVec& allFiles)
     {
-        std::cout << std::endl;
+        log << "Found " << g_metrics.matchedFiles.load(std::memory_order_relaxed) << " matching files" << std::endl;
+        log << "(FilesTraversed: " << travStats.numFiles
+            << ", DirsTraversed: " << travStats.numDirs;
+        if (travStats.numSkippedMounts != 0)
+            log << ", MountsSkipped: " << travStats.numSkippedMounts;
+        if (travStats.numRevisits != 0)
+            log << ", LinksRevisited: " << travStats.numRevisits;
+        if (travStats.numSingletons != 0)
+            log << ", SingletonsSkipped: " << travStats.numSingletons;
+        if (travStats.numResumed != 0)
+            log << ", Resumed: " << travStats.numResumed;
+        if (travStats.numOtherShards != 0)
+            log << ", OtherShards: " << travStats.numOtherShards;
+        log << " in " << travStats.timeMilliSecs << " milli-seconds)" << std::endl;
+
+        if (travStats.numErrors != 0)
+        {
+            log << "Errors: " << travStats.numErrors << " (";
+            for (auto iter = travStats.errorsByKind.begin(); iter != travStats.errorsByKind.end(); ++iter)
+                log << (iter == travStats.errorsByKind.begin() ? "" : ", ") << iter->first << ": " << iter->second;
+            log << ")" << std::endl;
+
+            for (const auto& error : travStats.errorPaths)
+                log << "  " << error.first << ": " << error.second << '\n';
+            if (travStats.numErrors > travStats.errorPaths.size())
+                log << "  ... " << (travStats.numErrors - travStats.errorPaths.size()) << " more" << '\n';
+        }
 
-        const auto& pd = allFiles[ng.m_duplicates.at(0)];
+        // spilled files are on disk, not in allFiles
+        if (opts.Verbose && opts.MemLimit == 0)
+        {
+            log << std::endl;
+            log << "Printing matching files: #" << allFiles.size() << std::endl;
+            log << "---------------------------------------" << std::endl;
+            for (const PathDetails& pd : allFiles)
+                log << "Size: " << std::setw(12) << pd.m_size << "  " << pd.m_path << '\n';
+            log << std::endl << std::endl;
+        }
+    };
+    events.onDirectories = [&](const ScanStats& travStats, long long ms)
+    {
+        log << std::endl;
+        log << "Found " << travStats.numDirGroups << " duplicate directories, " << travStats.numDirCopyFiles
+            << " files below their copies (" << ms << " ms)" << std::endl;
+    };
+    events.onCandidates = [&](size_t groups, uint64_t bytes, long long ms)
+    {
+        log << std::endl;
+        log << "Found " << groups << " potential duplicates (" << ms << " ms)" << std::endl;
+        progress.setContentBytesPlanned(bytes);
+    };
+    events.onVerified = [&](size_t groups, long long ms)
+    {
+        log << "Found " << groups << " groups with identical contents (" << ms << " ms)" << std::endl;
+    };
 
-        uniqRunningSize += pd.m_size;
+    Scanner scanner(scanOpts, std::move(events));
 
-        std::cout << pd.m_path.filename().string() << " " << pd.m_size << " * " << ng.m_duplicates.size() << std::endl;
-        std::cout << "---------------------------------------" << std::endl;
+    // Ctrl-C or a shutdown stops a journaled scan at the next entry, with the journal flushed
+    static Scanner* s_interruptible = nullptr;
+    if (!opts.CheckpointFile.empty())
+    {
+        s_interruptible = &scanner;
+        std::signal(SIGINT, [](int) { s_interruptible->cancel(); });
+        std::signal(SIGTERM, [](int) { s_interruptible->cancel(); });
+    }
 
-        for (int idx = 0; idx < ng.m_duplicates.size(); ++idx)
+    uint64_t totalRunningSize = 0;
+    uint64_t uniqRunningSize = 0;
+    uint64_t diskTotalSize = 0;
+    uint64_t diskUniqSize = 0;
+    size_t numGroups = 0;
+    auto emitGroup = [&](const NameBasedGroup& group, const PathDetailsVec& files)
+    {
+        // collected groups come with sorted members already, streamed ones are sorted here
+        auto pathLess = [&](size_t first, size_t second) { return pathBefore(files, first, second); };
+        NameBasedGroup sortedGroup{};
+        const bool isSorted = std::is_sorted(std::begin(group.m_duplicates), std::end(group.m_duplicates), pathLess);
+        if (!isSorted)
         {
-            const auto& pd2 = allFiles[ng.m_duplicates.at(idx)];
-
-            totalRunningSize += pd2.m_size;
-            std::cout << pd2.m_path.string() << std::endl;
+            sortedGroup = group;
+            sortMembers(sortedGroup.m_duplicates, files);
         }
+        const NameBasedGroup& ng = isSorted ? group : sortedGroup;
+
+        uniqRunningSize += files[ng.m_duplicates.at(0)].m_size;
+        totalRunningSize += ng.m_totalSize;
+        diskUniqSize += files[ng.m_duplicates.at(0)].m_allocated;
+        for (size_t idx : ng.m_duplicates)
+            diskTotalSize += files[idx].m_allocated;
+        ++numGroups;
+        g_metrics.groupsWritten.fetch_add(1, std::memory_order_relaxed);
+
+        g_metrics.beginPhase(Phase::Output);
+        groupWriter.writeGroup(ng, files);
+        if (writeBin)
+            binWriter.addGroup(ng, files);
+        g_metrics.endPhase(Phase::Output);
+    };
+
+    groupWriter.writeHeader();
+
+    std::string error{};
+    if (!scanner.run(emitGroup, error))
+    {
+        std::cerr << error << std::endl;
+        if (scanner.cancelled() && !opts.CheckpointFile.empty())
+            std::cerr << "continue with --checkpoint " << opts.CheckpointFile << " --resume" << std::endl;
+        return 1;
     }
 
-    if (totalRunningSize == 0)
+    if (scanner.deliversAsFound())
     {
-        for (const auto& pd : allFiles)
-            totalRunningSize += pd.m_size;
+        out.flush();
+        log << std::endl;
+        log << "Found " << numGroups << " potential duplicates (" << scanner.groupMilliSecs() << " ms)" << std::endl;
+    }
 
+    if (totalRunningSize == 0)
+    {
+        totalRunningSize = g_metrics.matchedBytes.load(std::memory_order_relaxed);
         uniqRunningSize = totalRunningSize;
+        diskTotalSize = g_metrics.matchedAllocated.load(std::memory_order_relaxed);
+        diskUniqSize = diskTotalSize;
+    }
+
+    progress.stop();
+    groupWriter.writeSummary(totalRunningSize, uniqRunningSize, diskTotalSize, diskUniqSize);
+    out.flush();
+
+    if (writeBin && !binWriter.finish())
+    {
+        std::cerr << "failed writing " << opts.OutBinFile << std::endl;
+        return 1;
     }
 
-    std::cout << std::endl;
+    g_metrics.bytesWritten.fetch_add(out.bytesWritten(), std::memory_order_relaxed);
+    mainThread.close();
 
-    std::cout << "Size including duplicates: " << totalRunningSize << " (" << toMB(totalRunningSize) << " MB)" << std::endl;
-    std::cout << "Size without duplicates:   " << uniqRunningSize  << " (" << toMB(uniqRunningSize)  << " MB)" << std::endl;
+    if (opts.PrintStats)
+        g_metrics.writeText(log);
 
-    std::cout << std::endl;
+    if (!opts.StatsJsonFile.empty())
+    {
+        std::ofstream statsJson(opts.StatsJsonFile);
+        g_metrics.writeJson(statsJson);
+        if (!statsJson)
+        {
+            std::cerr << "failed writing " << opts.StatsJsonFile << std::endl;
+            return 1;
+        }
+    }
 
-    return 0;
+    return out.good() ? 0 : 1;
 }
-
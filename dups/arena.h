@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <new>
+
+#ifdef __linux__
+    #include <sys/mman.h>
+#endif
+
+//--------------------------------------------------------------------------------------------
+// Upstream for phase arenas which maps blocks in multiples of 2 MiB and asks for transparent
+// huge pages on them, so a name index over millions of files doesn't cost a TLB miss per
+// bucket. Falls back to operator new where there is no mmap.
+class HugePageResource : public std::pmr::memory_resource
+{
+public:
+    static constexpr size_t HUGE_PAGE_BYTES = 2U << 20;
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override
+    {
+#ifdef __linux__
+        (void)alignment;    // mmap hands out whole pages
+        const size_t length = roundUp(bytes);
+        void* mem = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            throw std::bad_alloc();
+
+    #ifdef MADV_HUGEPAGE
+        ::madvise(mem, length, MADV_HUGEPAGE);
+    #endif
+        return mem;
+#else
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+#endif
+    }
+
+    void do_deallocate(void* mem, size_t bytes, size_t alignment) override
+    {
+#ifdef __linux__
+        (void)alignment;
+        ::munmap(mem, roundUp(bytes));
+#else
+        std::pmr::new_delete_resource()->deallocate(mem, bytes, alignment);
+#endif
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+
+    static size_t roundUp(size_t bytes)
+    {
+        return (bytes + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES;
+    }
+};
+
+// what phase arenas get their blocks from
+static inline std::pmr::memory_resource* arenaUpstream(bool hugePages)
+{
+    static HugePageResource hugePageResource{};
+    return hugePages ? static_cast<std::pmr::memory_resource*>(&hugePageResource)
+                     : std::pmr::new_delete_resource();
+}
+
+//--------------------------------------------------------------------------------------------
+// Monotonic arena for everything one phase allocates. Nothing is freed on its own, the arena
+// hands its blocks back in one go when it goes out of scope. Not thread safe, content workers
+// keep using the default resource.
+class PhaseArena
+{
+public:
+    explicit PhaseArena(std::pmr::memory_resource* upstream, size_t initialBytes = 1U << 20)
+        : m_upstream(upstream), m_arena(initialBytes, upstream)
+    {
+    }
+
+    PhaseArena(const PhaseArena&) = delete;
+    PhaseArena& operator=(const PhaseArena&) = delete;
+
+    std::pmr::memory_resource* resource() { return &m_arena; }
+    std::pmr::memory_resource* upstream() const { return m_upstream; }
+
+private:
+    std::pmr::memory_resource* m_upstream;
+    std::pmr::monotonic_buffer_resource m_arena;
+};
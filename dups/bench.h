@@ -0,0 +1,429 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <ostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+#include "types.h"
+
+//--------------------------------------------------------------------------------------------
+// Synthetic tree description, parsed from "key=value,key=value", e.g.
+//   depth=3,fanout=6,files=20000,collide=0.2,dups=0.3,near=0.5,size=log:512:4194304,runs=5,cache=cold
+//
+// collide  share of non duplicate files which reuse an existing name
+// near     share of those collisions which also keep the size and differ in the last byte only
+// dups     share of files which are byte identical copies (same name) of an earlier file
+// size     fixed:N, uniform:MIN:MAX or log:MIN:MAX (log-uniform, the usual long tail)
+//--------------------------------------------------------------------------------------------
+struct BenchSpec
+{
+    enum class SizeDist
+    {
+        Fixed,
+        Uniform,
+        LogUniform
+    };
+
+    uint32_t depth{ 3 };
+    uint32_t fanout{ 4 };
+    uint64_t files{ 10000 };
+    double   collide{ 0.2 };
+    double   near{ 0.5 };
+    double   dups{ 0.2 };
+    SizeDist sizeDist{ SizeDist::LogUniform };
+    uint64_t sizeMin{ 512 };
+    uint64_t sizeMax{ 1U << 20 };
+    uint64_t seed{ 1 };
+    uint32_t runs{ 3 };
+    bool     coldCache{ false };
+
+    std::string toString() const
+    {
+        static const char* DIST_NAMES[] = { "fixed", "uniform", "log" };
+
+        std::ostringstream oss;
+        oss << "depth=" << depth << ",fanout=" << fanout << ",files=" << files
+            << ",collide=" << collide << ",near=" << near << ",dups=" << dups
+            << ",size=" << DIST_NAMES[static_cast<int>(sizeDist)] << ":" << sizeMin;
+        if (sizeDist != SizeDist::Fixed)
+            oss << ":" << sizeMax;
+        oss << ",seed=" << seed;
+        return oss.str();
+    }
+};
+
+static inline bool parseBenchSpec(const std::string& spec, BenchSpec& out, std::string& error)
+{
+    std::istringstream items(spec);
+    std::string item;
+
+    while (std::getline(items, item, ','))
+    {
+        if (item.empty())
+            continue;
+
+        const size_t eq = item.find('=');
+        if (eq == std::string::npos)
+        {
+            error = "expected key=value, got " + item;
+            return false;
+        }
+
+        const std::string key = item.substr(0, eq);
+        const std::string value = item.substr(eq + 1);
+        try
+        {
+            if (key == "depth")         out.depth = static_cast<uint32_t>(std::stoul(value));
+            else if (key == "fanout")   out.fanout = static_cast<uint32_t>(std::stoul(value));
+            else if (key == "files")    out.files = std::stoull(value);
+            else if (key == "collide")  out.collide = std::stod(value);
+            else if (key == "near")     out.near = std::stod(value);
+            else if (key == "dups")     out.dups = std::stod(value);
+            else if (key == "seed")     out.seed = std::stoull(value);
+            else if (key == "runs")     out.runs = static_cast<uint32_t>(std::stoul(value));
+            else if (key == "cache")
+            {
+                if (value != "cold" && value != "warm")
+                {
+                    error = "cache must be cold or warm";
+                    return false;
+                }
+                out.coldCache = value == "cold";
+            }
+            else if (key == "size")
+            {
+                std::istringstream parts(value);
+                std::string kind, lo, hi;
+                std::getline(parts, kind, ':');
+                std::getline(parts, lo, ':');
+                std::getline(parts, hi, ':');
+
+                if (kind == "fixed")        out.sizeDist = BenchSpec::SizeDist::Fixed;
+                else if (kind == "uniform") out.sizeDist = BenchSpec::SizeDist::Uniform;
+                else if (kind == "log")     out.sizeDist = BenchSpec::SizeDist::LogUniform;
+                else
+                {
+                    error = "unknown size distribution " + kind;
+                    return false;
+                }
+
+                out.sizeMin = std::stoull(lo);
+                out.sizeMax = out.sizeDist == BenchSpec::SizeDist::Fixed ? out.sizeMin : std::stoull(hi);
+            }
+            else
+            {
+                error = "unknown bench key " + key;
+                return false;
+            }
+        }
+        catch (std::exception&)
+        {
+            error = "invalid value for " + key + ": " + value;
+            return false;
+        }
+    }
+
+    if (out.fanout == 0 || out.runs == 0 || out.sizeMin > out.sizeMax ||
+        out.collide < 0 || out.collide > 1 || out.near < 0 || out.near > 1 || out.dups < 0 || out.dups > 1)
+    {
+        error = "bench spec out of range: " + out.toString();
+        return false;
+    }
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------
+// Writes the tree described by spec below root. Only mt19937_64 output is used (no std
+// distributions, their results differ between standard libraries), so the same spec yields
+// the same tree everywhere. A marker file records the spec and lets later runs reuse the tree.
+class BenchTreeGenerator
+{
+public:
+    static constexpr const char* MARKER_FILE = ".lsdups-bench";
+
+    BenchTreeGenerator(const fs::path& root, const BenchSpec& spec)
+        : m_root(root), m_spec(spec), m_rng(spec.seed)
+    {
+    }
+
+    bool run(std::ostream& log, std::string& error)
+    {
+        const fs::path marker = m_root / MARKER_FILE;
+        std::error_code ec{};
+
+        if (fs::exists(marker, ec))
+        {
+            std::ifstream in(marker);
+            std::string previous{};
+            std::getline(in, previous);
+            if (previous == m_spec.toString())
+            {
+                log << "Reusing bench tree " << m_root.string() << std::endl;
+                return true;
+            }
+
+            // the marker proves the tree is ours to throw away
+            fs::remove_all(m_root, ec);
+        }
+        else if (fs::exists(m_root, ec) && !fs::is_empty(m_root, ec))
+        {
+            error = m_root.string() + " is not empty and was not created by --bench";
+            return false;
+        }
+
+        fs::create_directories(m_root, ec);
+        if (ec)
+        {
+            error = "unable to create " + m_root.string() + ": " + ec.message();
+            return false;
+        }
+
+        log << "Generating bench tree " << m_root.string() << " (" << m_spec.toString() << ")" << std::endl;
+
+        collectDirs(m_root, 0);
+        if (!writeFiles(error))
+            return false;
+
+        std::ofstream(marker) << m_spec.toString() << std::endl;
+        return true;
+    }
+
+private:
+    struct Original
+    {
+        std::string name;
+        uint64_t size;
+        uint64_t contentSeed;
+    };
+
+    void collectDirs(const fs::path& dir, uint32_t level)
+    {
+        m_dirs.emplace_back(dir);
+        if (level == m_spec.depth)
+            return;
+
+        for (uint32_t i = 0; i < m_spec.fanout; ++i)
+        {
+            fs::path child = dir / ("d" + std::to_string(level) + "_" + std::to_string(i));
+            fs::create_directory(child);
+            collectDirs(child, level + 1);
+        }
+    }
+
+    double nextUnit()
+    {
+        return (m_rng() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    uint64_t nextBelow(uint64_t bound)
+    {
+        return bound == 0 ? 0 : m_rng() % bound;
+    }
+
+    uint64_t nextSize()
+    {
+        switch (m_spec.sizeDist)
+        {
+        case BenchSpec::SizeDist::Fixed:
+            return m_spec.sizeMin;
+        case BenchSpec::SizeDist::Uniform:
+            return m_spec.sizeMin + nextBelow(m_spec.sizeMax - m_spec.sizeMin + 1);
+        case BenchSpec::SizeDist::LogUniform:
+        default:
+        {
+            const double lo = std::log(static_cast<double>(std::max<uint64_t>(m_spec.sizeMin, 1)));
+            const double hi = std::log(static_cast<double>(std::max<uint64_t>(m_spec.sizeMax, 1)));
+            const auto size = static_cast<uint64_t>(std::exp(lo + nextUnit() * (hi - lo)));
+            return std::clamp(size, m_spec.sizeMin, m_spec.sizeMax);
+        }
+        }
+    }
+
+    bool writeFiles(std::string& error)
+    {
+        std::vector<Original> originals{};
+        originals.reserve(static_cast<size_t>(m_spec.files));
+
+        for (uint64_t id = 0; id < m_spec.files; ++id)
+        {
+            const fs::path& dir = m_dirs[static_cast<size_t>(nextBelow(m_dirs.size()))];
+            Original file{};
+            bool flipLastByte = false;
+
+            if (!originals.empty() && nextUnit() < m_spec.dups)
+            {
+                file = originals[static_cast<size_t>(nextBelow(originals.size()))];
+            }
+            else
+            {
+                file.contentSeed = m_spec.seed * 0x9E3779B97F4A7C15ULL + id;
+                file.size = nextSize();
+                file.name = "f" + std::to_string(id) + ".dat";
+
+                if (!originals.empty() && nextUnit() < m_spec.collide)
+                {
+                    const Original& other = originals[static_cast<size_t>(nextBelow(originals.size()))];
+                    file.name = other.name;
+                    if (nextUnit() < m_spec.near)
+                    {
+                        // same name, same size and same head: only a full hash tells them apart
+                        file.size = other.size;
+                        file.contentSeed = other.contentSeed;
+                        flipLastByte = true;
+                    }
+                }
+                originals.emplace_back(file);
+            }
+
+            fs::path target = dir / file.name;
+            if (fs::exists(target))
+                target = dir / ("c" + std::to_string(id) + "_" + file.name);
+
+            if (!writeContent(target, file.size, file.contentSeed, flipLastByte))
+            {
+                error = "unable to write " + target.string();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool writeContent(const fs::path& path, uint64_t size, uint64_t contentSeed, bool flipLastByte)
+    {
+        FILE* file = std::fopen(path.string().c_str(), "wb");
+        if (file == nullptr)
+            return false;
+
+        std::mt19937_64 rng(contentSeed);
+        std::vector<uint64_t> chunk(8192);
+        uint64_t remaining = size;
+        bool ok = true;
+
+        while (remaining > 0 && ok)
+        {
+            for (auto& word : chunk)
+                word = rng();
+
+            auto* bytes = reinterpret_cast<unsigned char*>(chunk.data());
+            const size_t len = static_cast<size_t>(std::min<uint64_t>(remaining, chunk.size() * sizeof(uint64_t)));
+            if (remaining == len && flipLastByte)
+                bytes[len - 1] ^= 0xFF;
+
+            ok = std::fwrite(bytes, 1, len, file) == len;
+            remaining -= len;
+        }
+
+        return std::fclose(file) == 0 && ok;
+    }
+
+    fs::path m_root;
+    BenchSpec m_spec;
+    std::mt19937_64 m_rng;
+    std::vector<fs::path> m_dirs{};
+};
+
+//--------------------------------------------------------------------------------------------
+// Best effort cold cache: data pages of every file are dropped with fadvise, dentries and
+// inodes only go when we are allowed to write drop_caches (root). Returns whether the latter
+// worked, so reports can say how cold "cold" really was.
+static inline bool evictBenchTree(const fs::path& root)
+{
+#ifdef _WIN32
+    (void)root;
+    return false;
+#else
+    std::error_code ec{};
+    for (fs::recursive_directory_iterator it(root, ec), end; !ec && it != end; it.increment(ec))
+    {
+        if (!it->is_regular_file(ec))
+            continue;
+
+        int fd = ::open(it->path().c_str(), O_RDONLY);
+        if (fd < 0)
+            continue;
+        ::fdatasync(fd);
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        ::close(fd);
+    }
+
+    ::sync();
+    std::ofstream dropCaches("/proc/sys/vm/drop_caches");
+    if (!dropCaches)
+        return false;
+    dropCaches << "3" << std::endl;
+    return static_cast<bool>(dropCaches);
+#endif
+}
+
+//--------------------------------------------------------------------------------------------
+struct BenchRun
+{
+    double traverseMs{};
+    double groupMs{};
+    double contentMs{};
+    double outputMs{};
+    uint64_t files{};
+    uint64_t candidateGroups{};
+    uint64_t groups{};
+    bool fullyCold{};
+};
+
+static inline void writeBenchReport(std::ostream& out, const BenchSpec& spec, const std::string& root,
+                                    const std::vector<BenchRun>& runs)
+{
+    auto phaseSummary = [&](const char* name, double BenchRun::* field, bool last)
+    {
+        std::vector<double> values{};
+        for (const BenchRun& run : runs)
+            values.emplace_back(run.*field);
+        std::sort(values.begin(), values.end());
+
+        out << "    \"" << name << "\": {\"min\": " << values.front()
+            << ", \"median\": " << values[values.size() / 2]
+            << ", \"max\": " << values.back() << "}" << (last ? "\n" : ",\n");
+    };
+
+    out << std::fixed << std::setprecision(3);
+    out << "{\n";
+    out << "  \"spec\": \"" << spec.toString() << "\",\n";
+    out << "  \"root\": \"";
+    for (char c : root)
+        out << ((c == '"' || c == '\\') ? "\\" : "") << c;
+    out << "\",\n";
+    out << "  \"cache\": \"" << (spec.coldCache ? "cold" : "warm") << "\",\n";
+    out << "  \"runs\": [\n";
+    for (size_t i = 0; i < runs.size(); ++i)
+    {
+        const BenchRun& run = runs[i];
+        out << "    {\"traverse_ms\": " << run.traverseMs
+            << ", \"group_ms\": " << run.groupMs
+            << ", \"content_ms\": " << run.contentMs
+            << ", \"output_ms\": " << run.outputMs
+            << ", \"files\": " << run.files
+            << ", \"candidate_groups\": " << run.candidateGroups
+            << ", \"groups\": " << run.groups;
+        if (spec.coldCache)
+            out << ", \"fully_cold\": " << (run.fullyCold ? "true" : "false");
+        out << "}" << (i + 1 < runs.size() ? ",\n" : "\n");
+    }
+    out << "  ],\n";
+    out << "  \"summary_ms\": {\n";
+    phaseSummary("traverse", &BenchRun::traverseMs, false);
+    phaseSummary("group", &BenchRun::groupMs, false);
+    phaseSummary("content", &BenchRun::contentMs, false);
+    phaseSummary("output", &BenchRun::outputMs, true);
+    out << "  }\n";
+    out << "}" << std::endl;
+}
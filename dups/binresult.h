@@ -0,0 +1,463 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+#include "output.h"
+#include "types.h"
+
+//--------------------------------------------------------------------------------------------
+// Binary result file, native (little) endian, every section 8 byte aligned so it can be used
+// straight out of a memory mapping:
+//
+//   BinHeader
+//   string arena     NUL terminated paths
+//   BinFileRecord    [fileCount]   only files that are part of a group
+//   BinGroupRecord   [groupCount]  members of a group are files[firstFile, firstFile + fileCount)
+//
+// Bump BIN_RESULT_VERSION on any layout change, readers refuse versions they don't know.
+// Version 2 appended the shard fields to the header, version 1 files read as unsharded.
+//--------------------------------------------------------------------------------------------
+static constexpr char     BIN_RESULT_MAGIC[8]  = { 'L', 'S', 'D', 'U', 'P', 'B', 'I', 'N' };
+static constexpr uint32_t BIN_RESULT_VERSION   = 2;
+static constexpr uint32_t BIN_HEADER_V1_SIZE   = 64;
+
+struct BinHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint64_t fileCount;
+    uint64_t groupCount;
+    uint64_t filesOffset;
+    uint64_t groupsOffset;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+    uint32_t shardIndex;    // --shard i/N, shardCount 0 when the scan wasn't sharded
+    uint32_t shardCount;
+    uint64_t fingerprint;   // options of the scan, equal for all shards of one scan
+};
+
+struct BinFileRecord
+{
+    uint64_t pathOffset;    // relative to the string arena
+    uint64_t size;
+    uint32_t pathLen;       // without the terminating NUL
+    uint32_t reserved;
+};
+
+struct BinGroupRecord
+{
+    static constexpr uint32_t CONTENT_VERIFIED = 1U << 0;
+
+    uint64_t firstFile;
+    uint32_t fileCount;
+    uint32_t flags;
+    uint64_t fileSize;
+    uint64_t totalSize;
+    uint64_t hash;
+};
+
+static_assert(sizeof(BinHeader) == 80, "BinHeader layout changed");
+static_assert(sizeof(BinFileRecord) == 24, "BinFileRecord layout changed");
+static_assert(sizeof(BinGroupRecord) == 40, "BinGroupRecord layout changed");
+static_assert(std::is_trivially_copyable_v<BinHeader> &&
+              std::is_trivially_copyable_v<BinFileRecord> &&
+              std::is_trivially_copyable_v<BinGroupRecord>, "records are written as raw bytes");
+
+//--------------------------------------------------------------------------------------------
+// One record table on its way to the result file: appended to a scratch file next to it while
+// groups arrive, copied behind the string arena on finish(). Memory stays at one buffer
+// whatever the number of records.
+template <typename Record>
+class BinRecordSpool
+{
+public:
+    static constexpr size_t BUFFER_BYTES = 256U << 10;
+
+    BinRecordSpool() = default;
+    BinRecordSpool(const BinRecordSpool&) = delete;
+    BinRecordSpool& operator=(const BinRecordSpool&) = delete;
+
+    ~BinRecordSpool()
+    {
+        m_out.reset();
+        if (m_file != nullptr)
+            std::fclose(m_file);
+        if (!m_path.empty())
+        {
+            std::error_code ec{};
+            fs::remove(m_path, ec);
+        }
+    }
+
+    bool open(const fs::path& path)
+    {
+        m_path = path;
+        m_file = std::fopen(path.string().c_str(), "w+b");
+        if (m_file == nullptr)
+            return false;
+        m_out = std::make_unique<BufferedWriter>(m_file, BUFFER_BYTES);
+        return true;
+    }
+
+    void add(const Record& record)
+    {
+        m_out->write(reinterpret_cast<const char*>(&record), sizeof(record));
+        ++m_count;
+    }
+
+    uint64_t count() const { return m_count; }
+
+    // everything added so far, in order
+    bool copyTo(BufferedWriter& out)
+    {
+        m_out->flush();
+        if (!m_out->good() || std::fseek(m_file, 0, SEEK_SET) != 0)
+            return false;
+
+        std::vector<char> chunk(BUFFER_BYTES);
+        uint64_t left = m_count * sizeof(Record);
+        while (left != 0)
+        {
+            const size_t len = static_cast<size_t>(std::min<uint64_t>(left, chunk.size()));
+            if (std::fread(chunk.data(), 1, len, m_file) != len)
+                return false;
+            out.write(chunk.data(), len);
+            left -= len;
+        }
+        return true;
+    }
+
+private:
+    fs::path m_path{};
+    FILE* m_file{ nullptr };
+    std::unique_ptr<BufferedWriter> m_out{};
+    uint64_t m_count{ 0 };
+};
+
+//--------------------------------------------------------------------------------------------
+// Streams paths into the arena as groups arrive and the record tables into scratch files
+// beside the result (<file>.files.tmp, <file>.groups.tmp), which are appended on finish(),
+// after which the header is patched in place. Nothing grows with the number of groups.
+class BinResultWriter
+{
+public:
+    ~BinResultWriter()
+    {
+        m_out.reset();
+        if (m_file != nullptr)
+            std::fclose(m_file);
+    }
+
+    bool open(const fs::path& path)
+    {
+        if (!m_files.open(path.string() + ".files.tmp") || !m_groups.open(path.string() + ".groups.tmp"))
+            return false;
+
+        m_file = std::fopen(path.string().c_str(), "wb");
+        if (m_file == nullptr)
+            return false;
+
+        m_out = std::make_unique<BufferedWriter>(m_file);
+
+        BinHeader placeholder{};
+        m_out->write(reinterpret_cast<const char*>(&placeholder), sizeof(placeholder));
+        return true;
+    }
+
+    // marks the file as the partial result of shard index of count
+    void setShard(uint32_t index, uint32_t count, uint64_t fingerprint)
+    {
+        m_shardIndex = index;
+        m_shardCount = count;
+        m_fingerprint = fingerprint;
+    }
+
+    void addGroup(const NameBasedGroup& ng, const PathDetailsVec& allFiles)
+    {
+        addGroup(allFiles[ng.m_duplicates.at(0)].m_size, ng.m_duplicates.size(), ng.m_totalSize, ng.m_hash,
+            [&](size_t i)
+            {
+                const PathDetails& pd = allFiles[ng.m_duplicates[i]];
+                return std::make_pair(pd.m_path.string(), pd.m_size);
+            });
+    }
+
+    // memberAt(i) returns path and size of member i, for groups which don't come from a scan
+    template <typename MemberAt>
+    void addGroup(uint64_t fileSize, size_t count, uint64_t totalSize, uint64_t hash, MemberAt memberAt)
+    {
+        BinGroupRecord group{};
+        group.firstFile = m_files.count();
+        group.fileCount = static_cast<uint32_t>(count);
+        group.flags = hash != 0 ? BinGroupRecord::CONTENT_VERIFIED : 0U;
+        group.fileSize = fileSize;
+        group.totalSize = totalSize;
+        group.hash = hash;
+        m_groups.add(group);
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            const auto [path, size] = memberAt(i);
+
+            BinFileRecord file{};
+            file.pathOffset = m_stringsSize;
+            file.size = size;
+            file.pathLen = static_cast<uint32_t>(path.size());
+            m_files.add(file);
+
+            m_out->write(path.data(), path.size());
+            m_out->write("", 1);
+            m_stringsSize += path.size() + 1;
+        }
+    }
+
+    bool finish()
+    {
+        if (m_file == nullptr)
+            return false;
+
+        BinHeader header{};
+        std::memcpy(header.magic, BIN_RESULT_MAGIC, sizeof(header.magic));
+        header.version = BIN_RESULT_VERSION;
+        header.headerSize = sizeof(BinHeader);
+        header.fileCount = m_files.count();
+        header.groupCount = m_groups.count();
+        header.stringsOffset = sizeof(BinHeader);
+        header.stringsSize = m_stringsSize;
+        header.shardIndex = m_shardIndex;
+        header.shardCount = m_shardCount;
+        header.fingerprint = m_fingerprint;
+
+        const uint64_t padding = (8 - (m_stringsSize % 8)) % 8;
+        static const char zeros[8] = {};
+        m_out->write(zeros, padding);
+
+        header.filesOffset = header.stringsOffset + m_stringsSize + padding;
+        header.groupsOffset = header.filesOffset + m_files.count() * sizeof(BinFileRecord);
+
+        bool ok = m_files.copyTo(*m_out) && m_groups.copyTo(*m_out);
+        m_out->flush();
+
+        ok = ok && m_out->good() &&
+             std::fseek(m_file, 0, SEEK_SET) == 0 &&
+             std::fwrite(&header, sizeof(header), 1, m_file) == 1;
+
+        m_out.reset();
+        ok = std::fclose(m_file) == 0 && ok;
+        m_file = nullptr;
+        return ok;
+    }
+
+private:
+    FILE* m_file{ nullptr };
+    std::unique_ptr<BufferedWriter> m_out{};
+    BinRecordSpool<BinFileRecord> m_files{};
+    BinRecordSpool<BinGroupRecord> m_groups{};
+    uint64_t m_stringsSize{ 0 };
+    uint32_t m_shardIndex{ 0 };
+    uint32_t m_shardCount{ 0 };
+    uint64_t m_fingerprint{ 0 };
+};
+
+//--------------------------------------------------------------------------------------------
+// Read only mapping of a whole file
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile()
+    {
+        close();
+    }
+
+    bool open(const fs::path& path)
+    {
+        close();
+#ifdef _WIN32
+        HANDLE file = CreateFileA(path.string().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                                  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER size{};
+        if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+        {
+            HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mapping != nullptr)
+            {
+                m_data = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+                m_size = static_cast<size_t>(size.QuadPart);
+                CloseHandle(mapping);
+            }
+        }
+        CloseHandle(file);
+#else
+        int fd = ::open(path.string().c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat st{};
+        if (::fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            void* addr = ::mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+            if (addr != MAP_FAILED)
+            {
+                m_data = static_cast<const char*>(addr);
+                m_size = static_cast<size_t>(st.st_size);
+            }
+        }
+        ::close(fd);
+#endif
+        return m_data != nullptr;
+    }
+
+    void close()
+    {
+        if (m_data == nullptr)
+            return;
+#ifdef _WIN32
+        UnmapViewOfFile(m_data);
+#else
+        ::munmap(const_cast<char*>(m_data), m_size);
+#endif
+        m_data = nullptr;
+        m_size = 0;
+    }
+
+    const char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    const char* m_data{ nullptr };
+    size_t m_size{ 0 };
+};
+
+//--------------------------------------------------------------------------------------------
+// Zero copy view over a result file. open() only validates the header and section bounds, so
+// it costs the same for ten groups as for fifty million.
+class BinResultView
+{
+public:
+    bool open(const fs::path& path, std::string& error)
+    {
+        if (!m_map.open(path))
+        {
+            error = "unable to map " + path.string();
+            return false;
+        }
+
+        // copied, so the fields a version 1 header lacks read as zero
+        const auto* mapped = reinterpret_cast<const BinHeader*>(m_map.data());
+        const bool v1 = m_map.size() >= BIN_HEADER_V1_SIZE && mapped->version == 1 &&
+                        mapped->headerSize == BIN_HEADER_V1_SIZE;
+        if (!v1 && m_map.size() < sizeof(BinHeader))
+        {
+            error = "file too small for a header";
+            return false;
+        }
+        std::memcpy(&m_header, mapped, v1 ? BIN_HEADER_V1_SIZE : sizeof(BinHeader));
+        if (std::memcmp(m_header.magic, BIN_RESULT_MAGIC, sizeof(BIN_RESULT_MAGIC)) != 0)
+        {
+            error = "not an lsdups result file";
+            return false;
+        }
+
+        if (!v1 && (m_header.version != BIN_RESULT_VERSION || m_header.headerSize != sizeof(BinHeader)))
+        {
+            error = "unsupported result file version " + std::to_string(m_header.version);
+            return false;
+        }
+
+        const uint64_t size = m_map.size();
+        if (!sectionFits(m_header.stringsOffset, m_header.stringsSize, 1, size) ||
+            !sectionFits(m_header.filesOffset, m_header.fileCount, sizeof(BinFileRecord), size) ||
+            !sectionFits(m_header.groupsOffset, m_header.groupCount, sizeof(BinGroupRecord), size) ||
+            m_header.filesOffset % 8 != 0 || m_header.groupsOffset % 8 != 0)
+        {
+            error = "truncated or corrupt result file";
+            return false;
+        }
+
+        m_strings = m_map.data() + m_header.stringsOffset;
+        m_files = reinterpret_cast<const BinFileRecord*>(m_map.data() + m_header.filesOffset);
+        m_groups = reinterpret_cast<const BinGroupRecord*>(m_map.data() + m_header.groupsOffset);
+        return true;
+    }
+
+    uint64_t groupCount() const { return m_header.groupCount; }
+    uint64_t fileCount() const { return m_header.fileCount; }
+
+    uint32_t shardIndex() const { return m_header.shardIndex; }
+    uint32_t shardCount() const { return m_header.shardCount; }
+    uint64_t fingerprint() const { return m_header.fingerprint; }
+
+    const BinGroupRecord& group(size_t idx) const { return m_groups[idx]; }
+
+    // member count clamped to the file table, a corrupt record can't walk off the mapping
+    size_t memberCount(const BinGroupRecord& group) const
+    {
+        if (group.firstFile >= m_header.fileCount)
+            return 0;
+        return static_cast<size_t>(std::min<uint64_t>(group.fileCount, m_header.fileCount - group.firstFile));
+    }
+
+    const BinFileRecord& member(const BinGroupRecord& group, size_t idx) const
+    {
+        return m_files[group.firstFile + idx];
+    }
+
+    std::string_view path(const BinFileRecord& file) const
+    {
+        if (file.pathOffset > m_header.stringsSize || file.pathLen > m_header.stringsSize - file.pathOffset)
+            return {};
+        return std::string_view(m_strings + file.pathOffset, file.pathLen);
+    }
+
+    // leaf name of the first member, what text output uses as the group title. Directories
+    // (--dirs) keep their trailing separator.
+    std::string_view groupName(const BinGroupRecord& group) const
+    {
+        if (memberCount(group) == 0)
+            return {};
+
+        std::string_view first = path(member(group, 0));
+        size_t slash = first.size() < 2 ? std::string_view::npos : first.find_last_of("/\\", first.size() - 2);
+        return slash == std::string_view::npos ? first : first.substr(slash + 1);
+    }
+
+private:
+    static bool sectionFits(uint64_t offset, uint64_t count, uint64_t recordSize, uint64_t fileSize)
+    {
+        return offset <= fileSize && count <= (fileSize - offset) / recordSize;
+    }
+
+    MappedFile m_map{};
+    BinHeader m_header{};
+    const char* m_strings{ nullptr };
+    const BinFileRecord* m_files{ nullptr };
+    const BinGroupRecord* m_groups{ nullptr };
+};
@@ -0,0 +1,510 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#ifndef _WIN32
+    #include <unistd.h>
+#endif
+
+#include "types.h"
+
+//--------------------------------------------------------------------------------------------
+// Checkpoint log for --checkpoint / --resume, append only, native endian:
+//
+//   CheckpointHeader
+//   CheckpointRecord + payload, in the order things happened
+//
+// File       a matching file: size, allocated bytes, path
+// DirDone    a directory and everything below it was walked, all of its files are in the log
+// Traversed  the walk is complete, so is the file table
+// Verified   a name/size candidate went through the content stages: name, size, then every
+//            group of identical content as hash, member count and member paths
+//
+// Strings are a uint32_t length followed by the bytes. Records are collected in memory and
+// written by a background thread every CHECKPOINT_INTERVAL, walkers and content readers never
+// wait for the disk. A crash can leave a torn last record, loading stops in front of it.
+//
+// Bump CHECKPOINT_VERSION on any layout or content hash change, older logs are then refused.
+//--------------------------------------------------------------------------------------------
+static constexpr char     CHECKPOINT_MAGIC[8] = { 'L', 'S', 'D', 'U', 'P', 'C', 'K', 'P' };
+static constexpr uint32_t CHECKPOINT_VERSION  = 3;
+static constexpr auto     CHECKPOINT_INTERVAL = std::chrono::seconds(15);
+static constexpr size_t   REWRITE_BATCH_BYTES = 8U << 20;
+
+struct CheckpointHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint64_t fingerprint;   // hash of the options which decide what is found and grouped
+};
+
+struct CheckpointRecord
+{
+    enum Type : uint32_t
+    {
+        File = 1,
+        DirDone,
+        Traversed,
+        Verified
+    };
+
+    uint32_t type;
+    uint32_t payloadSize;
+};
+
+static_assert(sizeof(CheckpointHeader) == 24, "CheckpointHeader layout changed");
+static_assert(sizeof(CheckpointRecord) == 8, "CheckpointRecord layout changed");
+static_assert(std::is_trivially_copyable_v<CheckpointHeader> &&
+              std::is_trivially_copyable_v<CheckpointRecord>, "records are written as raw bytes");
+
+//--------------------------------------------------------------------------------------------
+class Checkpoint
+{
+public:
+    struct VerifiedGroup
+    {
+        uint64_t hash{};
+        std::vector<std::string> paths{};
+    };
+
+    Checkpoint() = default;
+    Checkpoint(const Checkpoint&) = delete;
+    Checkpoint& operator=(const Checkpoint&) = delete;
+
+    ~Checkpoint()
+    {
+        close();
+    }
+
+    // Starts a new log at path or, with resume, continues the one there if it was written with
+    // the same fingerprint. The valid part of an old log is rewritten into a fresh one first:
+    // files of directories which were only half walked are dropped, as that walk is repeated.
+    // Files carried over are appended to files.
+    bool open(const fs::path& path, uint64_t fingerprint, bool resume, PathDetailsVec& files, std::string& error)
+    {
+        m_path = path;
+        m_fingerprint = fingerprint;
+
+        std::error_code ec{};
+        const bool continuing = resume && fs::exists(path, ec);
+        if (continuing && (!load(files, error) || !rewrite(files, error)))
+            return false;
+
+        m_file = std::fopen(path.string().c_str(), continuing ? "ab" : "wb");
+        if (m_file == nullptr)
+        {
+            error = "unable to open checkpoint " + path.string();
+            return false;
+        }
+        if (!continuing)
+            writeHeader(m_file);
+
+        m_flusher = std::thread([this]() { flushLoop(); });
+        return true;
+    }
+
+    // state of the resumed scan
+    bool traversed() const { return m_traversed; }
+    bool dirDone(const fs::path& dir) const { return m_doneDirs.count(dir.string()) != 0; }
+
+    const std::vector<VerifiedGroup>* verified(const std::string& name, uint64_t size) const
+    {
+        const auto it = m_verified.find(verifiedKey(name, size));
+        return it == m_verified.end() ? nullptr : &it->second;
+    }
+
+    void addFile(const fs::path& path, uint64_t size, uint64_t allocated)
+    {
+        std::string payload{};
+        putU64(payload, size);
+        putU64(payload, allocated);
+        putString(payload, path.string());
+        append(CheckpointRecord::File, payload);
+    }
+
+    void addDirDone(const fs::path& dir)
+    {
+        std::string payload{};
+        putString(payload, dir.string());
+        append(CheckpointRecord::DirDone, payload);
+    }
+
+    // written out right away, a finished walk is the most expensive thing to lose
+    void addTraversed()
+    {
+        m_traversed = true;
+        m_doneDirs.clear();
+        append(CheckpointRecord::Traversed, {});
+
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_flushNow = true;
+        m_wake.notify_one();
+    }
+
+    void addVerified(const NameBasedGroup& candidate, const NameBasedGroupVec& sameContent,
+                     const PathDetailsVec& allFiles)
+    {
+        const PathDetails& first = allFiles[candidate.m_duplicates.at(0)];
+
+        std::vector<VerifiedGroup> groups{};
+        for (const NameBasedGroup& ng : sameContent)
+        {
+            VerifiedGroup group{ ng.m_hash, {} };
+            for (size_t idx : ng.m_duplicates)
+                group.paths.emplace_back(allFiles[idx].m_path.string());
+            groups.emplace_back(std::move(group));
+        }
+        append(CheckpointRecord::Verified, encodeVerified(first.m_path.filename().string(), first.m_size, groups));
+    }
+
+    // the scan is complete, nothing left to resume
+    void remove()
+    {
+        close();
+        std::error_code ec{};
+        fs::remove(m_path, ec);
+    }
+
+private:
+    //----------------------------------------------------------------------------------------
+    bool load(PathDetailsVec& files, std::string& error)
+    {
+        FILE* file = std::fopen(m_path.string().c_str(), "rb");
+        if (file == nullptr)
+        {
+            error = "unable to read checkpoint " + m_path.string();
+            return false;
+        }
+
+        CheckpointHeader header{};
+        if (std::fread(&header, sizeof(header), 1, file) != 1 ||
+            std::memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != CHECKPOINT_VERSION || header.headerSize != sizeof(header))
+        {
+            std::fclose(file);
+            error = m_path.string() + " is not a checkpoint of this lsdups version";
+            return false;
+        }
+        if (header.fingerprint != m_fingerprint)
+        {
+            std::fclose(file);
+            error = "checkpoint " + m_path.string() + " was written by a scan with other options";
+            return false;
+        }
+
+        std::error_code ec{};
+        uint64_t remaining = fs::file_size(m_path, ec) - sizeof(header);
+
+        PathDetailsVec logged{};
+        CheckpointRecord record{};
+        std::string payload{};
+        while (std::fread(&record, sizeof(record), 1, file) == 1)
+        {
+            // a torn header can claim any size, the file has to hold it
+            remaining -= std::min<uint64_t>(remaining, sizeof(record));
+            if (ec || record.payloadSize > remaining)
+                break;
+            remaining -= record.payloadSize;
+
+            payload.resize(record.payloadSize);
+            if (record.payloadSize != 0 && std::fread(&payload[0], record.payloadSize, 1, file) != 1)
+                break;
+
+            size_t pos = 0;
+            bool ok = true;
+            if (record.type == CheckpointRecord::File)
+            {
+                const uint64_t size = getU64(payload, pos, ok);
+                const uint64_t allocated = getU64(payload, pos, ok);
+                const std::string_view path = getString(payload, pos, ok);
+                if (ok)
+                    logged.emplace_back(PathDetails{ fs::path(path), size, allocated });
+            }
+            else if (record.type == CheckpointRecord::DirDone)
+            {
+                const std::string_view dir = getString(payload, pos, ok);
+                if (ok)
+                    m_doneDirs.emplace(dir);
+            }
+            else if (record.type == CheckpointRecord::Traversed)
+            {
+                m_traversed = true;
+            }
+            else if (record.type == CheckpointRecord::Verified)
+            {
+                ok = decodeVerified(payload);
+            }
+            else
+            {
+                ok = false;
+            }
+
+            // torn or foreign bytes, everything before them still counts
+            if (!ok)
+                break;
+        }
+        std::fclose(file);
+
+        for (PathDetails& pd : logged)
+        {
+            if (m_traversed || m_doneDirs.count(pd.m_path.parent_path().string()) != 0)
+                files.emplace_back(std::move(pd));
+        }
+        if (m_traversed)
+            m_doneDirs.clear();
+        return true;
+    }
+
+    // writes what load() kept into a new log and swaps it in
+    bool rewrite(const PathDetailsVec& files, std::string& error)
+    {
+        const fs::path temp = m_path.string() + ".tmp";
+        m_file = std::fopen(temp.string().c_str(), "wb");
+        if (m_file == nullptr)
+        {
+            error = "unable to create " + temp.string();
+            return false;
+        }
+
+        writeHeader(m_file);
+        for (const PathDetails& pd : files)
+        {
+            addFile(pd.m_path, pd.m_size, pd.m_allocated);
+            if (m_pending.size() >= REWRITE_BATCH_BYTES)
+                writePending();
+        }
+        for (const std::string& dir : m_doneDirs)
+            addDirDone(dir);
+        if (m_traversed)
+            append(CheckpointRecord::Traversed, {});
+        for (const auto& entry : m_verified)
+        {
+            const size_t sep = entry.first.find('\0');
+            append(CheckpointRecord::Verified,
+                   encodeVerified(entry.first.substr(0, sep), std::stoull(entry.first.substr(sep + 1)), entry.second));
+        }
+
+        const bool ok = writePending() && syncFile(m_file);
+        std::fclose(m_file);
+        m_file = nullptr;
+
+        std::error_code ec{};
+        if (ok)
+            fs::rename(temp, m_path, ec);
+        if (!ok || ec)
+        {
+            fs::remove(temp, ec);
+            error = "unable to rewrite checkpoint " + m_path.string();
+            return false;
+        }
+        return true;
+    }
+
+    //----------------------------------------------------------------------------------------
+    void append(CheckpointRecord::Type type, const std::string& payload)
+    {
+        const CheckpointRecord record{ type, static_cast<uint32_t>(payload.size()) };
+
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_pending.append(reinterpret_cast<const char*>(&record), sizeof(record));
+        m_pending.append(payload);
+    }
+
+    void flushLoop()
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+        while (!m_stop)
+        {
+            m_wake.wait_for(lock, CHECKPOINT_INTERVAL, [this]() { return m_stop || m_flushNow; });
+            m_flushNow = false;
+
+            lock.unlock();
+            writePending() && syncFile(m_file);
+            lock.lock();
+        }
+    }
+
+    // only ever called by one thread at a time, after a failed write the log stays as it is so
+    // no record ends up behind a torn one
+    bool writePending()
+    {
+        std::string batch{};
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            batch.swap(m_pending);
+        }
+
+        if (m_failed || batch.empty())
+            return !m_failed;
+        m_failed = std::fwrite(batch.data(), 1, batch.size(), m_file) != batch.size() || std::fflush(m_file) != 0;
+        return !m_failed;
+    }
+
+    static bool syncFile(FILE* file)
+    {
+#ifndef _WIN32
+        return ::fsync(::fileno(file)) == 0;
+#else
+        (void)file;
+        return true;
+#endif
+    }
+
+    void close()
+    {
+        if (m_flusher.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                m_stop = true;
+                m_wake.notify_one();
+            }
+            m_flusher.join();
+        }
+
+        if (m_file != nullptr)
+        {
+            writePending() && syncFile(m_file);
+            std::fclose(m_file);
+            m_file = nullptr;
+        }
+    }
+
+    void writeHeader(FILE* file) const
+    {
+        CheckpointHeader header{};
+        std::memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+        header.version = CHECKPOINT_VERSION;
+        header.headerSize = sizeof(header);
+        header.fingerprint = m_fingerprint;
+        std::fwrite(&header, sizeof(header), 1, file);
+    }
+
+    //----------------------------------------------------------------------------------------
+    static std::string verifiedKey(const std::string& name, uint64_t size)
+    {
+        return name + '\0' + std::to_string(size);
+    }
+
+    static std::string encodeVerified(const std::string& name, uint64_t size, const std::vector<VerifiedGroup>& groups)
+    {
+        std::string payload{};
+        putString(payload, name);
+        putU64(payload, size);
+        putU32(payload, static_cast<uint32_t>(groups.size()));
+        for (const VerifiedGroup& group : groups)
+        {
+            putU64(payload, group.hash);
+            putU32(payload, static_cast<uint32_t>(group.paths.size()));
+            for (const std::string& path : group.paths)
+                putString(payload, path);
+        }
+        return payload;
+    }
+
+    bool decodeVerified(const std::string& payload)
+    {
+        size_t pos = 0;
+        bool ok = true;
+        const std::string name(getString(payload, pos, ok));
+        const uint64_t size = getU64(payload, pos, ok);
+
+        // every count is bounded by the payload, so a torn record can't ask for gigabytes
+        const uint32_t groupCount = getU32(payload, pos, ok);
+        if (!ok || groupCount > payload.size())
+            return false;
+
+        std::vector<VerifiedGroup> groups(groupCount);
+        for (VerifiedGroup& group : groups)
+        {
+            group.hash = getU64(payload, pos, ok);
+            const uint32_t memberCount = getU32(payload, pos, ok);
+            if (!ok || memberCount > payload.size())
+                return false;
+            group.paths.resize(memberCount);
+            for (std::string& path : group.paths)
+                path = getString(payload, pos, ok);
+            if (!ok)
+                return false;
+        }
+
+        if (ok)
+            m_verified[verifiedKey(name, size)] = std::move(groups);
+        return ok;
+    }
+
+    static void putU32(std::string& out, uint32_t value)
+    {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    static void putU64(std::string& out, uint64_t value)
+    {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    static void putString(std::string& out, std::string_view str)
+    {
+        putU32(out, static_cast<uint32_t>(str.size()));
+        out.append(str.data(), str.size());
+    }
+
+    template <typename T>
+    static T getValue(const std::string& in, size_t& pos, bool& ok)
+    {
+        T value{};
+        if (!ok || in.size() - pos < sizeof(T))
+        {
+            ok = false;
+            return value;
+        }
+        std::memcpy(&value, in.data() + pos, sizeof(T));
+        pos += sizeof(T);
+        return value;
+    }
+
+    static uint32_t getU32(const std::string& in, size_t& pos, bool& ok) { return getValue<uint32_t>(in, pos, ok); }
+    static uint64_t getU64(const std::string& in, size_t& pos, bool& ok) { return getValue<uint64_t>(in, pos, ok); }
+
+    static std::string_view getString(const std::string& in, size_t& pos, bool& ok)
+    {
+        const uint32_t len = getU32(in, pos, ok);
+        if (!ok || in.size() - pos < len)
+        {
+            ok = false;
+            return {};
+        }
+        const std::string_view str(in.data() + pos, len);
+        pos += len;
+        return str;
+    }
+
+    fs::path m_path{};
+    uint64_t m_fingerprint{ 0 };
+    FILE* m_file{ nullptr };
+
+    bool m_traversed{ false };
+    std::unordered_set<std::string> m_doneDirs{};
+    std::unordered_map<std::string, std::vector<VerifiedGroup>> m_verified{};
+
+    std::mutex m_lock{};
+    std::condition_variable m_wake{};
+    std::string m_pending{};
+    bool m_flushNow{ false };
+    bool m_stop{ false };
+    bool m_failed{ false };
+    std::thread m_flusher{};
+};
@@ -0,0 +1,796 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+#include "device.h"
+#include "metrics.h"
+#include "throttle.h"
+#include "types.h"
+
+//--------------------------------------------------------------------------------------------
+// Streaming XXH64, fast enough that hashing stays bound by the disk rather than the cpu
+class ContentHasher
+{
+public:
+    explicit ContentHasher(uint64_t seed = 0)
+        : m_seed(seed)
+    {
+        m_acc[0] = seed + PRIME1 + PRIME2;
+        m_acc[1] = seed + PRIME2;
+        m_acc[2] = seed;
+        m_acc[3] = seed - PRIME1;
+    }
+
+    void update(const void* data, size_t len)
+    {
+        const auto* p = static_cast<const uint8_t*>(data);
+        const uint8_t* const end = p + len;
+        m_totalLen += len;
+
+        if (m_bufferLen + len < sizeof(m_buffer))
+        {
+            std::memcpy(m_buffer + m_bufferLen, p, len);
+            m_bufferLen += len;
+            return;
+        }
+
+        if (m_bufferLen != 0)
+        {
+            const size_t fill = sizeof(m_buffer) - m_bufferLen;
+            std::memcpy(m_buffer + m_bufferLen, p, fill);
+            consumeStripe(m_buffer);
+            p += fill;
+            m_bufferLen = 0;
+        }
+
+        for (; p + sizeof(m_buffer) <= end; p += sizeof(m_buffer))
+            consumeStripe(p);
+
+        m_bufferLen = static_cast<size_t>(end - p);
+        std::memcpy(m_buffer, p, m_bufferLen);
+    }
+
+    uint64_t digest() const
+    {
+        uint64_t h = 0;
+        if (m_totalLen >= sizeof(m_buffer))
+        {
+            h = rotl(m_acc[0], 1) + rotl(m_acc[1], 7) + rotl(m_acc[2], 12) + rotl(m_acc[3], 18);
+            for (uint64_t acc : m_acc)
+                h = (h ^ round(0, acc)) * PRIME1 + PRIME4;
+        }
+        else
+        {
+            h = m_seed + PRIME5;
+        }
+
+        h += m_totalLen;
+
+        const uint8_t* p = m_buffer;
+        const uint8_t* const end = m_buffer + m_bufferLen;
+        for (; p + 8 <= end; p += 8)
+            h = rotl(h ^ round(0, read64(p)), 27) * PRIME1 + PRIME4;
+
+        if (p + 4 <= end)
+        {
+            h = rotl(h ^ (read32(p) * PRIME1), 23) * PRIME2 + PRIME3;
+            p += 4;
+        }
+
+        for (; p < end; ++p)
+            h = rotl(h ^ (*p * PRIME5), 11) * PRIME1;
+
+        h ^= h >> 33;
+        h *= PRIME2;
+        h ^= h >> 29;
+        h *= PRIME3;
+        h ^= h >> 32;
+        return h;
+    }
+
+    // same as update() with len zero bytes without touching memory, still one round per
+    // stripe: BlockHasher keeps that to the block edges of a hole
+    void updateZeros(uint64_t len)
+    {
+        static const uint8_t zeros[sizeof(m_buffer)] = {};
+        const uint64_t fill = std::min<uint64_t>(len, (sizeof(m_buffer) - m_bufferLen) % sizeof(m_buffer));
+        update(zeros, static_cast<size_t>(fill));
+        len -= fill;
+
+        m_totalLen += len - len % sizeof(m_buffer);
+        for (uint64_t stripes = len / sizeof(m_buffer); stripes != 0; --stripes)
+        {
+            for (uint64_t& acc : m_acc)
+                acc = round(acc, 0);
+        }
+        update(zeros, static_cast<size_t>(len % sizeof(m_buffer)));
+    }
+
+    static uint64_t hash(const void* data, size_t len, uint64_t seed = 0)
+    {
+        ContentHasher hasher(seed);
+        hasher.update(data, len);
+        return hasher.digest();
+    }
+
+private:
+    static constexpr uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+    static constexpr uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+    static constexpr uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+    static constexpr uint64_t PRIME4 = 0x85EBCA77C2B2AE63ULL;
+    static constexpr uint64_t PRIME5 = 0x27D4EB2F165667C5ULL;
+
+    static uint64_t rotl(uint64_t x, int r)
+    {
+        return (x << r) | (x >> (64 - r));
+    }
+
+    static uint64_t read64(const uint8_t* p)
+    {
+        uint64_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static uint64_t read32(const uint8_t* p)
+    {
+        uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static uint64_t round(uint64_t acc, uint64_t input)
+    {
+        return rotl(acc + input * PRIME2, 31) * PRIME1;
+    }
+
+    void consumeStripe(const uint8_t* p)
+    {
+        for (int i = 0; i < 4; ++i)
+            m_acc[i] = round(m_acc[i], read64(p + i * 8));
+    }
+
+    uint64_t m_seed;
+    uint64_t m_acc[4];
+    uint8_t  m_buffer[32]{};
+    size_t   m_bufferLen{ 0 };
+    uint64_t m_totalLen{ 0 };
+};
+
+//--------------------------------------------------------------------------------------------
+// What content reads leave behind in the page cache. keep reads normally, drop advises the
+// kernel to drop every chunk once it is hashed, direct bypasses the cache with O_DIRECT so a
+// verification pass over terabytes doesn't evict the hot pages of everything else on the host.
+enum class CachePolicy
+{
+    Keep,
+    Drop,
+    Direct
+};
+
+static inline CachePolicy cachePolicyFromString(const std::string& str)
+{
+    if (str == "drop")
+        return CachePolicy::Drop;
+    else if (str == "direct")
+        return CachePolicy::Direct;
+    else
+        return CachePolicy::Keep;
+}
+
+// O_DIRECT wants buffer, offset and length aligned to the logical block size; 4 KiB covers it
+// on everything but exotic devices
+static constexpr size_t DIRECT_IO_ALIGN = 4096;
+
+static inline uint64_t alignUp(uint64_t bytes, uint64_t alignment)
+{
+    return (bytes + alignment - 1) / alignment * alignment;
+}
+
+// start of a DIRECT_IO_ALIGN aligned region of at least bytes inside buffer, which is grown as
+// needed. Buffers are per worker, so this is the pool direct reads draw from.
+static inline std::byte* alignedData(FileMemBuffer& buffer, size_t bytes)
+{
+    if (buffer.size() < bytes + DIRECT_IO_ALIGN)
+        buffer.resize(bytes + DIRECT_IO_ALIGN);
+
+    void* data = buffer.data();
+    size_t space = buffer.size();
+    return static_cast<std::byte*>(std::align(DIRECT_IO_ALIGN, bytes, data, space));
+}
+
+//--------------------------------------------------------------------------------------------
+// One file opened for content reads under a cache policy. direct falls back to drop where the
+// filesystem refuses O_DIRECT (tmpfs, some fuse mounts). Reads must be sequential on Windows,
+// where the policy is ignored.
+class ContentFile
+{
+public:
+    ContentFile(const fs::path& path, CachePolicy policy)
+        : m_policy(policy)
+    {
+#ifndef _WIN32
+        const int flags = O_RDONLY | O_CLOEXEC;
+    #ifdef O_DIRECT
+        if (policy == CachePolicy::Direct)
+            m_fd = ::open(path.c_str(), flags | O_DIRECT);
+    #endif
+        if (m_fd < 0)
+        {
+            m_fd = ::open(path.c_str(), flags);
+            if (m_policy == CachePolicy::Direct)
+                m_policy = CachePolicy::Drop;
+        }
+    #ifdef POSIX_FADV_SEQUENTIAL
+        if (m_fd >= 0 && m_policy == CachePolicy::Drop)
+            ::posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    #endif
+#else
+        m_file = std::fopen(path.string().c_str(), "rb");
+#endif
+    }
+
+    ContentFile(const ContentFile&) = delete;
+    ContentFile& operator=(const ContentFile&) = delete;
+
+    ~ContentFile()
+    {
+#ifndef _WIN32
+        if (m_fd >= 0)
+            ::close(m_fd);
+#else
+        if (m_file != nullptr)
+            std::fclose(m_file);
+#endif
+    }
+
+    bool isOpen() const
+    {
+#ifndef _WIN32
+        return m_fd >= 0;
+#else
+        return m_file != nullptr;
+#endif
+    }
+
+    // bytes a read of len has to have room for in its buffer
+    size_t readSpan(size_t len) const
+    {
+        return m_policy == CachePolicy::Direct ? static_cast<size_t>(alignUp(len, DIRECT_IO_ALIGN)) : len;
+    }
+
+    // Extent map of sparse files: the next hole at or after offset, and the next data at or
+    // after offset, UINT64_MAX for no hole and the file size for no data when unknown. Without
+    // SEEK_HOLE support (or on windows) the whole file is data.
+    uint64_t holeAt(uint64_t offset) const
+    {
+#if !defined(_WIN32) && defined(SEEK_HOLE)
+        const off_t hole = ::lseek(m_fd, static_cast<off_t>(offset), SEEK_HOLE);
+        if (hole >= 0)
+            return static_cast<uint64_t>(hole);
+#else
+        (void)offset;
+#endif
+        return UINT64_MAX;
+    }
+
+    uint64_t dataAt(uint64_t offset) const
+    {
+#if !defined(_WIN32) && defined(SEEK_DATA)
+        const off_t data = ::lseek(m_fd, static_cast<off_t>(offset), SEEK_DATA);
+        if (data >= 0)
+            return static_cast<uint64_t>(data);
+
+        // ENXIO: only a hole up to the end, which is also where a shrunk file ends
+        struct stat st{};
+        if (errno == ENXIO && ::fstat(m_fd, &st) == 0)
+            return std::max(offset, static_cast<uint64_t>(st.st_size));
+#endif
+        return offset;
+    }
+
+    // reads up to len bytes at offset with one call, returns how many. With direct, out must be
+    // aligned with room for readSpan(len) and offset aligned.
+    size_t read(std::byte* out, size_t len, uint64_t offset, bool& ok)
+    {
+        g_ioThrottle.acquire(readSpan(len));
+#ifndef _WIN32
+        const ssize_t got = ::pread(m_fd, out, readSpan(len), static_cast<off_t>(offset));
+        ok = got >= 0;
+        if (got <= 0)
+            return 0;
+    #ifdef POSIX_FADV_DONTNEED
+        if (m_policy == CachePolicy::Drop)
+            ::posix_fadvise(m_fd, static_cast<off_t>(offset), got, POSIX_FADV_DONTNEED);
+    #endif
+        return std::min(static_cast<size_t>(got), len);
+#else
+        (void)offset;
+        const size_t got = std::fread(out, 1, len, m_file);
+        ok = std::ferror(m_file) == 0;
+        return got;
+#endif
+    }
+
+private:
+    CachePolicy m_policy;
+#ifndef _WIN32
+    int m_fd{ -1 };
+#else
+    FILE* m_file{ nullptr };
+#endif
+};
+
+//--------------------------------------------------------------------------------------------
+// File content hash: ContentHasher over every HASH_BLOCK_BYTES block, and over the block hashes
+// once there is more than one. A zero block always hashes alike, so a hole costs one round per
+// block instead of one per stripe, and content of up to one block hashes as ContentHasher does.
+static constexpr uint64_t HASH_BLOCK_BYTES = 1U << 20;
+
+class BlockHasher
+{
+public:
+    void update(const void* data, size_t len)
+    {
+        const auto* p = static_cast<const uint8_t*>(data);
+        while (len != 0)
+        {
+            nextBlock();
+            const size_t take = static_cast<size_t>(std::min<uint64_t>(len, HASH_BLOCK_BYTES - m_blockLen));
+            m_block.update(p, take);
+            m_blockLen += take;
+            p += take;
+            len -= take;
+        }
+    }
+
+    void updateZeros(uint64_t len)
+    {
+        while (len != 0)
+        {
+            nextBlock();
+            if (m_blockLen == 0 && len > HASH_BLOCK_BYTES)
+            {
+                // whole blocks short of the last, which stays open for what follows
+                const uint64_t zeroHash = zeroBlockHash();
+                for (uint64_t blocks = (len - 1) / HASH_BLOCK_BYTES; blocks != 0; --blocks)
+                {
+                    m_blocks.update(&zeroHash, sizeof(zeroHash));
+                    len -= HASH_BLOCK_BYTES;
+                }
+                m_multiBlock = true;
+            }
+            const uint64_t take = std::min(len, HASH_BLOCK_BYTES - m_blockLen);
+            m_block.updateZeros(take);
+            m_blockLen += take;
+            len -= take;
+        }
+    }
+
+    uint64_t digest() const
+    {
+        if (!m_multiBlock)
+            return m_block.digest();
+
+        ContentHasher blocks = m_blocks;
+        const uint64_t last = m_block.digest();
+        blocks.update(&last, sizeof(last));
+        return blocks.digest();
+    }
+
+private:
+    // a full block is only folded in once more content follows it
+    void nextBlock()
+    {
+        if (m_blockLen != HASH_BLOCK_BYTES)
+            return;
+        const uint64_t hash = m_block.digest();
+        m_blocks.update(&hash, sizeof(hash));
+        m_block = ContentHasher{};
+        m_blockLen = 0;
+        m_multiBlock = true;
+    }
+
+    static uint64_t zeroBlockHash()
+    {
+        static const uint64_t hash = [] {
+            ContentHasher hasher{};
+            hasher.updateZeros(HASH_BLOCK_BYTES);
+            return hasher.digest();
+        }();
+        return hash;
+    }
+
+    ContentHasher m_block{};
+    ContentHasher m_blocks{};
+    uint64_t m_blockLen{ 0 };
+    bool m_multiBlock{ false };
+};
+
+//--------------------------------------------------------------------------------------------
+static constexpr uint64_t HEAD_HASH_BYTES  = 4096;
+static constexpr size_t   READ_CHUNK_BYTES = 256 * 1024;
+
+static_assert(READ_CHUNK_BYTES % DIRECT_IO_ALIGN == 0 && HEAD_HASH_BYTES % DIRECT_IO_ALIGN == 0,
+              "direct reads start at aligned offsets only");
+
+// Next hole worth skipping in [offset, maxBytes), as [holeStart, holeEnd); both maxBytes when
+// there is none. Holes are shrunk to DIRECT_IO_ALIGN boundaries, so reads around them stay
+// aligned, and a hole that leaves nothing after that is read like data. A hole running past
+// the end of a file that shrank ends there, the read after it then fails.
+static inline void nextHole(const ContentFile& file, uint64_t offset, uint64_t maxBytes,
+                            uint64_t& holeStart, uint64_t& holeEnd)
+{
+    holeStart = maxBytes;
+    holeEnd = maxBytes;
+    for (uint64_t probe = offset; probe < maxBytes;)
+    {
+        const uint64_t hole = file.holeAt(probe);
+        if (hole >= maxBytes)
+            return;
+
+        const uint64_t data = std::min(file.dataAt(hole), maxBytes);
+        const uint64_t start = alignUp(hole, DIRECT_IO_ALIGN);
+        const uint64_t end = data == maxBytes ? maxBytes : data / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN;
+        if (start < end)
+        {
+            holeStart = start;
+            holeEnd = end;
+            return;
+        }
+        if (data <= probe)
+            return;
+        probe = data;
+    }
+}
+
+// hashes up to maxBytes from the start of the file, false when it could not be read fully.
+// Holes of sparse files aren't read, they hash as the zeros they stand for, so a sparse file
+// and a dense copy of it still hash alike. Dense files skip looking for holes.
+static inline bool hashFile(const fs::path& path, uint64_t maxBytes, bool sparse, FileMemBuffer& buffer,
+                            uint64_t& hash, StageMetrics& stats, CachePolicy policy = CachePolicy::Keep)
+{
+    const uint64_t fileStart = nowNanos();
+    uint64_t readNanos = 0, hashNanos = 0;
+
+    ContentFile file(path, policy);
+    if (!file.isOpen())
+    {
+        stats.readErrors.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    std::byte* chunk = alignedData(buffer, READ_CHUNK_BYTES);
+    BlockHasher hasher{};
+    uint64_t offset = 0;
+    bool ok = true;
+
+    while (ok && offset < maxBytes)
+    {
+        // data up to the next hole, which is hashed as zeros without reading it
+        uint64_t holeStart = maxBytes;
+        uint64_t holeEnd = maxBytes;
+        if (sparse)
+            nextHole(file, offset, maxBytes, holeStart, holeEnd);
+
+        while (offset < holeStart)
+        {
+            const size_t want = static_cast<size_t>(std::min<uint64_t>(holeStart - offset, READ_CHUNK_BYTES));
+            const uint64_t t0 = nowNanos();
+            bool readOk = true;
+            const size_t got = file.read(chunk, want, offset, readOk);
+            const uint64_t t1 = nowNanos();
+            readNanos += t1 - t0;
+            stats.bytesRead.fetch_add(got, std::memory_order_relaxed);
+
+            if (!readOk || got != want)
+            {
+                // file shrank or went away under us, it can't be proven identical
+                ok = false;
+                break;
+            }
+            hasher.update(chunk, got);
+            hashNanos += nowNanos() - t1;
+            offset += got;
+        }
+
+        if (ok && holeEnd > holeStart)
+        {
+            const uint64_t t0 = nowNanos();
+            hasher.updateZeros(holeEnd - holeStart);
+            hashNanos += nowNanos() - t0;
+            stats.holeBytes.fetch_add(holeEnd - holeStart, std::memory_order_relaxed);
+            offset = holeEnd;
+        }
+    }
+
+    hash = hasher.digest();
+
+    stats.filesRead.fetch_add(1, std::memory_order_relaxed);
+    stats.readNanos.fetch_add(readNanos, std::memory_order_relaxed);
+    stats.hashNanos.fetch_add(hashNanos, std::memory_order_relaxed);
+    stats.fileMicros.record((nowNanos() - fileStart) / 1000);
+    if (!ok)
+        stats.readErrors.fetch_add(1, std::memory_order_relaxed);
+    return ok;
+}
+
+//--------------------------------------------------------------------------------------------
+// Files up to SMALL_FILE_BYTES are read whole, once, and compared byte for byte instead of
+// going through head and full hash with a reopen in between. A group is only batched while
+// all of its members fit SMALL_BATCH_BYTES together.
+static constexpr uint64_t SMALL_FILE_BYTES  = 64 * 1024;
+static constexpr uint64_t SMALL_BATCH_BYTES = 16U << 20;
+
+// bytes one small file occupies in the batch buffer, direct reads need aligned slots
+static inline size_t smallSlotBytes(uint64_t fileSize, CachePolicy policy)
+{
+    return static_cast<size_t>(policy == CachePolicy::Direct ? alignUp(fileSize, DIRECT_IO_ALIGN) : fileSize);
+}
+
+// reads exactly size bytes into out with a single read call, false when the file is shorter
+static inline bool readWholeFile(const fs::path& path, uint64_t size, std::byte* out, StageMetrics& stats,
+                                 CachePolicy policy)
+{
+    const uint64_t t0 = nowNanos();
+    bool ok = false;
+    size_t got = 0;
+
+    ContentFile file(path, policy);
+    if (file.isOpen())
+    {
+        got = file.read(out, static_cast<size_t>(size), 0, ok);
+        ok = ok && got == size;
+    }
+
+    const uint64_t elapsed = nowNanos() - t0;
+    stats.filesRead.fetch_add(1, std::memory_order_relaxed);
+    stats.bytesRead.fetch_add(got, std::memory_order_relaxed);
+    stats.readNanos.fetch_add(elapsed, std::memory_order_relaxed);
+    stats.fileMicros.record(elapsed / 1000);
+    if (!ok)
+        stats.readErrors.fetch_add(1, std::memory_order_relaxed);
+    return ok;
+}
+
+//--------------------------------------------------------------------------------------------
+using ContentGroupCallback = std::function<void(NameBasedGroup&&)>;
+
+// Partitions indices by the hash of their first maxBytes, calls onSplit for every bucket of
+// two or more. Unreadable files are dropped from the candidate set.
+static inline void splitByHash(const IndexVec& indices, const PathDetailsVec& allFiles, uint64_t maxBytes,
+                               ContentStage stage, CachePolicy policy, FileMemBuffer& buffer,
+                               const std::function<void(IndexVec&&, uint64_t)>& onSplit)
+{
+    StageMetrics& stats = g_metrics.stage(stage);
+    stats.candidatesIn.fetch_add(indices.size(), std::memory_order_relaxed);
+
+    std::vector<std::pair<uint64_t, size_t>> hashed{};
+    hashed.reserve(indices.size());
+
+    for (size_t idx : indices)
+    {
+        uint64_t hash = 0;
+        const PathDetails& file = allFiles[idx];
+        if (hashFile(file.m_path, maxBytes, file.m_allocated < file.m_size, buffer, hash, stats, policy))
+            hashed.emplace_back(hash, idx);
+    }
+
+    std::sort(std::begin(hashed), std::end(hashed));
+
+    for (size_t start = 0, end = 0; start < hashed.size(); start = end)
+    {
+        for (end = start + 1; end < hashed.size() && hashed[end].first == hashed[start].first; ++end)
+            ;
+
+        if (end - start > 1)
+        {
+            IndexVec split{};
+            split.reserve(end - start);
+            for (size_t i = start; i < end; ++i)
+                split.emplace_back(hashed[i].second);
+
+            stats.survivors.fetch_add(split.size(), std::memory_order_relaxed);
+            onSplit(std::move(split), hashed[start].first);
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------------------
+// Small file groups: every member is read into one slot of buffer, slots are sorted by their
+// bytes and equal runs of two or more become groups. Only the survivors get hashed, for the
+// group hash the output carries.
+static inline void refineSmallFiles(const NameBasedGroup& group, const PathDetailsVec& allFiles, uint64_t fileSize,
+                                    CachePolicy policy, FileMemBuffer& buffer, const ContentGroupCallback& onGroup)
+{
+    StageMetrics& stats = g_metrics.stage(ContentStage::Small);
+    const IndexVec& indices = group.m_duplicates;
+    stats.candidatesIn.fetch_add(indices.size(), std::memory_order_relaxed);
+
+    const size_t fileBytes = static_cast<size_t>(fileSize);
+    const size_t slotBytes = smallSlotBytes(fileSize, policy);
+    std::byte* const slotData = alignedData(buffer, slotBytes * indices.size());
+
+    // (slot, file index) of everything read in full
+    std::vector<std::pair<size_t, size_t>> slots{};
+    slots.reserve(indices.size());
+    for (size_t idx : indices)
+    {
+        const size_t slot = slots.size();
+        if (readWholeFile(allFiles[idx].m_path, fileSize, slotData + slot * slotBytes, stats, policy))
+            slots.emplace_back(slot, idx);
+    }
+
+    const uint64_t t0 = nowNanos();
+    auto compare = [&](size_t a, size_t b)
+    {
+        return fileBytes == 0 ? 0 : std::memcmp(slotData + a * slotBytes, slotData + b * slotBytes, fileBytes);
+    };
+
+    std::sort(std::begin(slots), std::end(slots),
+        [&](const auto& a, const auto& b)
+        {
+            const int c = compare(a.first, b.first);
+            return c != 0 ? c < 0 : a.second < b.second;
+        });
+
+    for (size_t start = 0, end = 0; start < slots.size(); start = end)
+    {
+        for (end = start + 1; end < slots.size() && compare(slots[end].first, slots[start].first) == 0; ++end)
+            ;
+
+        if (end - start > 1)
+        {
+            IndexVec same{};
+            same.reserve(end - start);
+            for (size_t i = start; i < end; ++i)
+                same.emplace_back(slots[i].second);
+
+            const uint64_t hash = ContentHasher::hash(slotData + slots[start].first * slotBytes, fileBytes);
+            stats.survivors.fetch_add(same.size(), std::memory_order_relaxed);
+            onGroup(NameBasedGroup{ std::move(same), fileSize * (end - start), hash });
+        }
+    }
+    stats.hashNanos.fetch_add(nowNanos() - t0, std::memory_order_relaxed);
+}
+
+//--------------------------------------------------------------------------------------------
+// Splits a name/size group into groups of identical content. Cheap head hashes weed out most
+// of the mismatches before anything is read in full.
+static inline void refineByContent(const NameBasedGroup& group, const PathDetailsVec& allFiles, CachePolicy policy,
+                                   FileMemBuffer& buffer, const ContentGroupCallback& onGroup)
+{
+    const uint64_t fileSize = allFiles[group.m_duplicates.at(0)].m_size;
+
+    auto emit = [&](IndexVec&& indices, uint64_t hash)
+    {
+        const uint64_t total = fileSize * indices.size();
+        onGroup(NameBasedGroup{ std::move(indices), total, hash });
+    };
+
+    if (fileSize <= SMALL_FILE_BYTES && smallSlotBytes(fileSize, policy) * group.m_duplicates.size() <= SMALL_BATCH_BYTES)
+    {
+        refineSmallFiles(group, allFiles, fileSize, policy, buffer, onGroup);
+        return;
+    }
+
+    if (fileSize <= HEAD_HASH_BYTES)
+    {
+        splitByHash(group.m_duplicates, allFiles, fileSize, ContentStage::Full, policy, buffer, emit);
+        return;
+    }
+
+    splitByHash(group.m_duplicates, allFiles, HEAD_HASH_BYTES, ContentStage::Head, policy, buffer,
+        [&](IndexVec&& sameHead, uint64_t)
+        {
+            splitByHash(sameHead, allFiles, fileSize, ContentStage::Full, policy, buffer, emit);
+        });
+}
+
+//--------------------------------------------------------------------------------------------
+// Runs refineByContent on one worker pool per device, sized by the kind of device, so a slow
+// spinning disk gets a single reader while an SSD next to it is read in parallel. A group goes
+// to the device of its first file. onGroup is called under a lock from whichever worker
+// finished the split. Setting cancel makes the workers stop after the group they are on.
+//
+// onRefined, if set, gets every candidate once it is done, with all of its groups of identical
+// content (before onGroup sees them), under the same lock.
+using RefinedCallback = std::function<void(const NameBasedGroup& candidate, const NameBasedGroupVec& sameContent)>;
+
+static inline void refineOnDevicePools(const NameBasedGroupVec& groups, const PathDetailsVec& allFiles,
+                                       const DeviceLimits& limits, CachePolicy policy,
+                                       const ContentGroupCallback& onGroup,
+                                       const std::atomic<bool>* cancel = nullptr,
+                                       const RefinedCallback& onRefined = {})
+{
+    struct DeviceQueue
+    {
+        DeviceKind kind{ DeviceKind::Unknown };
+        std::vector<size_t> groups{};
+        std::atomic<size_t> next{ 0 };
+    };
+
+    DeviceTable devices{};
+    std::map<uint64_t, std::unique_ptr<DeviceQueue>> queues{};
+    for (size_t g = 0; g < groups.size(); ++g)
+    {
+        const DeviceTable::Device device = devices.deviceOf(allFiles[groups[g].m_duplicates.at(0)].m_path);
+        std::unique_ptr<DeviceQueue>& queue = queues[device.id];
+        if (!queue)
+        {
+            queue = std::make_unique<DeviceQueue>();
+            queue->kind = device.kind;
+        }
+        queue->groups.emplace_back(g);
+    }
+
+    std::mutex onGroupLock{};
+    std::vector<std::thread> workers{};
+    size_t deviceNo = 0;
+
+    for (auto& entry : queues)
+    {
+        DeviceQueue& queue = *entry.second;
+        const size_t threads = std::min<size_t>(limits.get(queue.kind), queue.groups.size());
+
+        for (size_t t = 0; t < threads; ++t)
+        {
+            std::string name = deviceKindName(queue.kind) + std::to_string(deviceNo) + "." + std::to_string(t);
+            workers.emplace_back([&, name]()
+            {
+                Metrics::ThreadScope scope(g_metrics, name);
+                FileMemBuffer buffer{};
+                NameBasedGroupVec refined{};
+
+                for (size_t i = queue.next.fetch_add(1); i < queue.groups.size(); i = queue.next.fetch_add(1))
+                {
+                    if (cancel != nullptr && cancel->load(std::memory_order_relaxed))
+                        break;
+
+                    const NameBasedGroup& candidate = groups[queue.groups[i]];
+                    if (!onRefined)
+                    {
+                        refineByContent(candidate, allFiles, policy, buffer,
+                            [&](NameBasedGroup&& sameContent)
+                            {
+                                std::lock_guard<std::mutex> lock(onGroupLock);
+                                onGroup(std::move(sameContent));
+                            });
+                        continue;
+                    }
+
+                    refined.clear();
+                    refineByContent(candidate, allFiles, policy, buffer,
+                        [&](NameBasedGroup&& sameContent) { refined.emplace_back(std::move(sameContent)); });
+
+                    std::lock_guard<std::mutex> lock(onGroupLock);
+                    onRefined(candidate, refined);
+                    for (NameBasedGroup& sameContent : refined)
+                        onGroup(std::move(sameContent));
+                }
+            });
+        }
+        ++deviceNo;
+    }
+
+    for (std::thread& worker : workers)
+        worker.join();
+}
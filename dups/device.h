@@ -0,0 +1,180 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <thread>
+
+#ifdef __linux__
+    #include <sys/stat.h>
+    #include <sys/statfs.h>
+    #include <sys/sysmacros.h>
+#endif
+
+#include "types.h"
+
+//--------------------------------------------------------------------------------------------
+// What a device tolerates in terms of parallel reads. Spinning disks seek themselves to death
+// with more than one reader, SSDs want a deep queue and network mounts sit in between.
+enum class DeviceKind
+{
+    Rotational,
+    Solid,
+    Network,
+    Unknown,
+    Count
+};
+
+static inline const char* deviceKindName(DeviceKind kind)
+{
+    switch (kind)
+    {
+    case DeviceKind::Rotational: return "hdd";
+    case DeviceKind::Solid:      return "ssd";
+    case DeviceKind::Network:    return "net";
+    default:                     return "other";
+    }
+}
+
+//--------------------------------------------------------------------------------------------
+// reader threads per device, by kind
+struct DeviceLimits
+{
+    uint32_t threads[static_cast<size_t>(DeviceKind::Count)]{};
+
+    static DeviceLimits Defaults()
+    {
+        DeviceLimits limits{};
+        limits.set(DeviceKind::Rotational, 1);
+        limits.set(DeviceKind::Solid, std::max(4U, std::thread::hardware_concurrency()));
+        limits.set(DeviceKind::Network, 4);
+        limits.set(DeviceKind::Unknown, 4);
+        return limits;
+    }
+
+    uint32_t get(DeviceKind kind) const { return threads[static_cast<size_t>(kind)]; }
+    void set(DeviceKind kind, uint32_t count) { threads[static_cast<size_t>(kind)] = count; }
+};
+
+// "hdd=1,ssd=16,net=4,other=2" overrides single kinds, a plain number sets all of them
+static inline bool parseDeviceLimits(const std::string& spec, DeviceLimits& limits, std::string& error)
+{
+    size_t start = 0;
+    while (start < spec.size())
+    {
+        size_t end = spec.find(',', start);
+        if (end == std::string::npos)
+            end = spec.size();
+
+        const std::string item = spec.substr(start, end - start);
+        const size_t eq = item.find('=');
+        const std::string key = eq == std::string::npos ? std::string{} : item.substr(0, eq);
+        const std::string value = eq == std::string::npos ? item : item.substr(eq + 1);
+
+        unsigned long count = 0;
+        try
+        {
+            size_t pos = 0;
+            count = std::stoul(value, &pos);
+            if (pos != value.size() || count == 0 || count > 256)
+                throw std::invalid_argument(value);
+        }
+        catch (std::exception&)
+        {
+            error = "thread count must be 1..256 in '" + item + "'";
+            return false;
+        }
+
+        bool known = key.empty();
+        for (size_t k = 0; k < static_cast<size_t>(DeviceKind::Count); ++k)
+        {
+            if (key.empty() || key == deviceKindName(static_cast<DeviceKind>(k)))
+            {
+                limits.threads[k] = static_cast<uint32_t>(count);
+                known = true;
+            }
+        }
+
+        if (!known)
+        {
+            error = "unknown device kind '" + key + "', expected hdd, ssd, net or other";
+            return false;
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------
+// Device a file lives on plus what kind of device that is, the kind is looked up once per
+// device. Everything maps to one unknown device where st_dev isn't available.
+class DeviceTable
+{
+public:
+    struct Device
+    {
+        uint64_t id;
+        DeviceKind kind;
+    };
+
+    Device deviceOf(const fs::path& path)
+    {
+#ifdef __linux__
+        struct stat st{};
+        if (::stat(path.c_str(), &st) != 0)
+            return Device{ 0, DeviceKind::Unknown };
+
+        const uint64_t id = static_cast<uint64_t>(st.st_dev);
+        auto iter = m_kinds.find(id);
+        if (iter == m_kinds.end())
+            iter = m_kinds.emplace(id, detectKind(path, st.st_dev)).first;
+        return Device{ id, iter->second };
+#else
+        (void)path;
+        return Device{ 0, DeviceKind::Unknown };
+#endif
+    }
+
+private:
+#ifdef __linux__
+    static DeviceKind detectKind(const fs::path& path, dev_t dev)
+    {
+        struct statfs sfs{};
+        if (::statfs(path.c_str(), &sfs) == 0)
+        {
+            switch (static_cast<uint32_t>(sfs.f_type))
+            {
+            case 0x6969:        // nfs
+            case 0x517B:        // smb
+            case 0xFF534D42:    // cifs
+            case 0xFE534D42:    // smb2
+            case 0x00C36400:    // ceph
+                return DeviceKind::Network;
+            default:
+                break;
+            }
+        }
+
+        // partitions don't have a queue of their own, their parent disk does
+        const std::string sysDev = "/sys/dev/block/" + std::to_string(major(dev)) + ":" + std::to_string(minor(dev));
+        for (const char* queue : { "/queue/rotational", "/../queue/rotational" })
+        {
+            FILE* file = std::fopen((sysDev + queue).c_str(), "r");
+            if (file == nullptr)
+                continue;
+
+            const int flag = std::fgetc(file);
+            std::fclose(file);
+            if (flag == '1')
+                return DeviceKind::Rotational;
+            if (flag == '0')
+                return DeviceKind::Solid;
+        }
+        return DeviceKind::Unknown;
+    }
+#endif
+
+    std::map<uint64_t, DeviceKind> m_kinds{};
+};
@@ -0,0 +1,363 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <numeric>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "content.h"
+#include "pipeline.h"
+#include "types.h"
+
+//--------------------------------------------------------------------------------------------
+// Whole duplicate directories (--dirs). The directories holding the matched files are rebuilt
+// from their paths and hashed bottom-up, Merkle style: a directory's hash covers the sorted
+// (name, size[, content]) of its files and the (name, hash) of its subdirectories, so two
+// directories hash alike exactly when everything below them does. Only matched files count,
+// -p/--skip/--min-size decide what "everything" is.
+//
+// With content verification the first round hashes metadata only, the files below directories
+// which found a twin are then verified like any name/size candidates and a second round hashes
+// their contents in.
+//--------------------------------------------------------------------------------------------
+struct DirectoryGroups
+{
+    PathDetailsVec dirs{};          // group members, paths end in a separator, sizes sum up all below
+    NameBasedGroupVec groups{};     // canonical order, members by path
+    size_t filesDropped{ 0 };       // files below the copies, taken out of allFiles
+};
+
+// verifies candidates the way the scan does, files is what their indices refer to
+using ContentRefiner = std::function<void(const NameBasedGroupVec& candidates, const PathDetailsVec& files,
+                                          const ContentGroupCallback& onSameContent)>;
+
+using NativeString = fs::path::string_type;
+using NativeView = std::basic_string_view<fs::path::value_type>;
+
+// last component of path as a view into it, no temporary path per file
+static inline NativeView pathLeaf(const fs::path& path)
+{
+    static constexpr fs::path::value_type SEPARATORS[] = { '/', fs::path::preferred_separator, 0 };
+    const NativeView native(path.native());
+    const size_t slash = native.find_last_of(SEPARATORS);
+    return slash == NativeView::npos ? native : native.substr(slash + 1);
+}
+
+//--------------------------------------------------------------------------------------------
+class DirectoryTree
+{
+public:
+    DirectoryTree(const PathDetailsVec& allFiles, const PathVec& roots)
+        : m_allFiles(allFiles), m_fileDir(allFiles.size())
+    {
+        // roots in the form their children's parent_path() takes, nothing above them was walked
+        std::vector<NativeString> rootKeys{};
+        for (const fs::path& root : roots)
+            rootKeys.emplace_back((root / "x").parent_path().native());
+
+        std::unordered_map<NativeString, size_t> byPath{};
+        for (size_t i = 0; i < allFiles.size(); ++i)
+        {
+            fs::path dir = allFiles[i].m_path.parent_path();
+            size_t child = NO_DIR;
+            bool first = true;
+            while (true)
+            {
+                auto [iter, added] = byPath.try_emplace(dir.native(), m_dirs.size());
+                if (added)
+                    m_dirs.emplace_back(Dir{ dir, dir.filename().native() });
+
+                Dir& entry = m_dirs[iter->second];
+                if (first)
+                {
+                    m_fileDir[i] = iter->second;
+                    entry.files.emplace_back(i);
+                }
+                else
+                {
+                    entry.subdirs.emplace_back(child);
+                }
+
+                const bool isRoot = std::find(rootKeys.begin(), rootKeys.end(), dir.native()) != rootKeys.end();
+                fs::path parent = dir.parent_path();
+                if (!added || isRoot || parent == dir || parent.empty())
+                    break;
+
+                child = iter->second;
+                dir = std::move(parent);
+                first = false;
+            }
+        }
+
+        for (size_t d = 0; d < m_dirs.size(); ++d)
+            for (size_t sub : m_dirs[d].subdirs)
+                m_dirs[sub].parent = d;
+
+        // a parent's path is a prefix of its children's, longest first is children first
+        m_bottomUp.resize(m_dirs.size());
+        std::iota(m_bottomUp.begin(), m_bottomUp.end(), size_t{ 0 });
+        std::sort(m_bottomUp.begin(), m_bottomUp.end(),
+            [&](size_t a, size_t b) { return m_dirs[a].path.native().size() > m_dirs[b].path.native().size(); });
+
+        for (size_t d : m_bottomUp)
+        {
+            Dir& dir = m_dirs[d];
+            for (size_t f : dir.files)
+            {
+                dir.bytes += allFiles[f].m_size;
+                dir.allocated += allFiles[f].m_allocated;
+            }
+            dir.fileCount = dir.files.size();
+            for (size_t sub : dir.subdirs)
+            {
+                dir.bytes += m_dirs[sub].bytes;
+                dir.allocated += m_dirs[sub].allocated;
+                dir.fileCount += m_dirs[sub].fileCount;
+            }
+        }
+    }
+
+    // contentIds, when given, are compared along with the metadata Keys groups files by
+    template <typename Keys>
+    void hash(const std::vector<uint64_t>* contentIds)
+    {
+        std::vector<Entry> entries{};
+        std::string buffer{};
+        for (size_t d : m_bottomUp)
+        {
+            Dir& dir = m_dirs[d];
+            entries.clear();
+            for (size_t f : dir.files)
+            {
+                const uint64_t size = Keys::template has<SizeKey> ? m_allFiles[f].m_size : 0;
+                const uint64_t content = contentIds != nullptr ? (*contentIds)[f] : 0;
+                entries.emplace_back(Entry{ pathLeaf(m_allFiles[f].m_path), false, size, content });
+            }
+            for (size_t sub : dir.subdirs)
+                entries.emplace_back(Entry{ m_dirs[sub].name, true, m_dirs[sub].hash, 0 });
+
+            std::sort(entries.begin(), entries.end(),
+                [](const Entry& a, const Entry& b) { return a.name != b.name ? a.name < b.name : a.isDir < b.isDir; });
+
+            buffer.clear();
+            for (const Entry& entry : entries)
+            {
+                buffer.append(reinterpret_cast<const char*>(entry.name.data()), entry.name.size() * sizeof(fs::path::value_type));
+                buffer.push_back('\0');
+                buffer.push_back(entry.isDir ? 'd' : 'f');
+                buffer.append(reinterpret_cast<const char*>(&entry.value), sizeof(entry.value));
+                buffer.append(reinterpret_cast<const char*>(&entry.content), sizeof(entry.content));
+            }
+            dir.hash = ContentHasher::hash(buffer.data(), buffer.size());
+        }
+    }
+
+    // directories with at least one twin, bucketed by hash. A directory holding a single file
+    // is left to the file groups.
+    std::vector<IndexVec> twins() const
+    {
+        std::unordered_map<uint64_t, IndexVec> byHash{};
+        for (size_t d = 0; d < m_dirs.size(); ++d)
+        {
+            if (m_dirs[d].fileCount > 1)
+                byHash[m_dirs[d].hash].emplace_back(d);
+        }
+
+        std::vector<IndexVec> result{};
+        for (auto& entry : byHash)
+        {
+            if (entry.second.size() > 1)
+                result.emplace_back(std::move(entry.second));
+        }
+        return result;
+    }
+
+    // every file below one of dirs
+    IndexVec filesBelow(const IndexVec& dirs) const
+    {
+        const std::vector<bool> below = markBelow(dirs);
+        IndexVec files{};
+        for (size_t f = 0; f < m_fileDir.size(); ++f)
+        {
+            if (below[m_fileDir[f]])
+                files.emplace_back(f);
+        }
+        return files;
+    }
+
+    std::vector<bool> markBelow(const IndexVec& dirs) const
+    {
+        std::vector<bool> below(m_dirs.size(), false);
+        for (size_t d : dirs)
+            below[d] = true;
+        for (auto iter = m_bottomUp.rbegin(); iter != m_bottomUp.rend(); ++iter)
+        {
+            const size_t parent = m_dirs[*iter].parent;
+            if (parent != NO_DIR && below[parent])
+                below[*iter] = true;
+        }
+        return below;
+    }
+
+    // a group is implied by its parents' when they all are one group of twins already
+    bool impliedByParents(const IndexVec& group, const std::vector<size_t>& twinGroupOf) const
+    {
+        const size_t parent = m_dirs[group.front()].parent;
+        if (parent == NO_DIR || twinGroupOf[parent] == NO_DIR)
+            return false;
+        return std::all_of(group.begin(), group.end(),
+            [&](size_t d)
+            {
+                const size_t p = m_dirs[d].parent;
+                return p != NO_DIR && twinGroupOf[p] == twinGroupOf[parent];
+            });
+    }
+
+    size_t dirCount() const { return m_dirs.size(); }
+    const fs::path& path(size_t d) const { return m_dirs[d].path; }
+    uint64_t bytes(size_t d) const { return m_dirs[d].bytes; }
+    uint64_t allocated(size_t d) const { return m_dirs[d].allocated; }
+    uint64_t hashOf(size_t d) const { return m_dirs[d].hash; }
+    size_t dirOf(size_t file) const { return m_fileDir[file]; }
+
+    static constexpr size_t NO_DIR = SIZE_MAX;
+
+private:
+    struct Dir
+    {
+        fs::path path{};
+        NativeString name{};
+        IndexVec files{};
+        IndexVec subdirs{};
+        size_t parent{ NO_DIR };
+        uint64_t bytes{ 0 };
+        uint64_t allocated{ 0 };
+        size_t fileCount{ 0 };
+        uint64_t hash{ 0 };
+    };
+
+    struct Entry
+    {
+        NativeView name;
+        bool isDir;
+        uint64_t value;     // file size or subdirectory hash
+        uint64_t content;
+    };
+
+    const PathDetailsVec& m_allFiles;
+    std::vector<Dir> m_dirs{};
+    IndexVec m_fileDir{};
+    IndexVec m_bottomUp{};
+};
+
+//--------------------------------------------------------------------------------------------
+// Finds the groups of identical directories and takes the files below all but the first
+// member of each out of allFiles, the file groups then report one copy only. Groups inside a
+// reported group are left out, unless they have members outside of it.
+template <typename Keys>
+static inline DirectoryGroups findDuplicateDirectories(PathDetailsVec& allFiles, const PathVec& roots,
+                                                       uint64_t minTotal, const ContentRefiner& refine)
+{
+    DirectoryGroups result{};
+    DirectoryTree tree(allFiles, roots);
+    tree.hash<Keys>(nullptr);
+    std::vector<IndexVec> twins = tree.twins();
+
+    if constexpr (Keys::verifiesContent)
+    {
+        // the files below the candidates, as name/size groups of two or more
+        IndexVec candidates{};
+        for (const IndexVec& group : twins)
+            candidates.insert(candidates.end(), group.begin(), group.end());
+        IndexVec files = tree.filesBelow(candidates);
+
+        auto before = [&](size_t a, size_t b)
+        {
+            if (allFiles[a].m_size != allFiles[b].m_size)
+                return allFiles[a].m_size < allFiles[b].m_size;
+            return pathLeaf(allFiles[a].m_path) < pathLeaf(allFiles[b].m_path);
+        };
+        std::sort(files.begin(), files.end(), before);
+
+        NameBasedGroupVec nameSizeGroups{};
+        for (size_t start = 0, end = 0; start < files.size(); start = end)
+        {
+            for (end = start + 1; end < files.size() && !before(files[start], files[end]); ++end)
+                ;
+            if (end - start > 1)
+            {
+                IndexVec same(files.begin() + start, files.begin() + end);
+                nameSizeGroups.emplace_back(NameBasedGroup{ std::move(same), allFiles[files[start]].m_size * (end - start), 0 });
+            }
+        }
+
+        // files without a twin of identical content get an id of their own
+        std::vector<uint64_t> contentIds(allFiles.size());
+        for (size_t f = 0; f < contentIds.size(); ++f)
+            contentIds[f] = ~uint64_t{ 0 } - f;
+        refine(nameSizeGroups, allFiles,
+            [&](NameBasedGroup&& sameContent)
+            {
+                for (size_t f : sameContent.m_duplicates)
+                    contentIds[f] = sameContent.m_hash;
+            });
+
+        tree.hash<Keys>(&contentIds);
+        twins = tree.twins();
+    }
+
+    std::vector<size_t> twinGroupOf(tree.dirCount(), DirectoryTree::NO_DIR);
+    for (size_t g = 0; g < twins.size(); ++g)
+        for (size_t d : twins[g])
+            twinGroupOf[d] = g;
+
+    IndexVec copies{};
+    for (IndexVec& group : twins)
+    {
+        if (tree.impliedByParents(group, twinGroupOf))
+            continue;
+
+        const uint64_t bytes = tree.bytes(group.front());
+        if (bytes * group.size() < minTotal)
+            continue;
+
+        std::sort(group.begin(), group.end(), [&](size_t a, size_t b) { return tree.path(a).native() < tree.path(b).native(); });
+        copies.insert(copies.end(), group.begin() + 1, group.end());
+
+        NameBasedGroup ng{};
+        for (size_t d : group)
+        {
+            ng.m_duplicates.emplace_back(result.dirs.size());
+            result.dirs.emplace_back(PathDetails{ tree.path(d) / "", bytes, tree.allocated(d) });
+        }
+        ng.m_totalSize = bytes * group.size();
+        ng.m_hash = Keys::verifiesContent ? tree.hashOf(group.front()) : 0;
+        result.groups.emplace_back(std::move(ng));
+    }
+
+    std::sort(result.groups.begin(), result.groups.end(),
+        [&](const NameBasedGroup& a, const NameBasedGroup& b)
+        {
+            if (a.m_totalSize != b.m_totalSize)
+                return a.m_totalSize > b.m_totalSize;
+            return result.dirs[a.m_duplicates.front()].m_path.native() < result.dirs[b.m_duplicates.front()].m_path.native();
+        });
+
+    // nested copies are covered by marking below their outermost ones
+    const std::vector<bool> dropped = tree.markBelow(copies);
+    PathDetailsVec kept{};
+    kept.reserve(allFiles.size());
+    for (size_t f = 0; f < allFiles.size(); ++f)
+    {
+        if (dropped[tree.dirOf(f)])
+            ++result.filesDropped;
+        else
+            kept.emplace_back(std::move(allFiles[f]));
+    }
+    allFiles = std::move(kept);
+    return result;
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <system_error>
+#include <unordered_set>
+
+#ifdef _WIN32
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#else
+    #include <sys/stat.h>
+    #include <sys/types.h>
+#endif
+
+#include "types.h"
+
+//--------------------------------------------------------------------------------------------
+// Identity of a file or directory independent of the path it was reached by: (st_dev, st_ino),
+// or volume serial and file index on windows.
+struct FileId
+{
+    uint64_t device;
+    uint64_t inode;
+
+    bool operator==(const FileId& other) const
+    {
+        return device == other.device && inode == other.inode;
+    }
+};
+
+struct FileIdHash
+{
+    size_t operator()(const FileId& id) const
+    {
+        // inodes are dense and devices few, a multiplicative mix of both spreads them well enough
+        return static_cast<size_t>((id.inode * 0x9E3779B97F4A7C15ULL) ^ (id.device * 0xC2B2AE3D27D4EB4FULL));
+    }
+};
+
+#ifdef _WIN32
+// bytes a file takes up on its volume, less than its size when sparse or compressed
+static inline uint64_t compressedSizeOf(const fs::path& path, uint64_t fallback)
+{
+    DWORD high = 0;
+    const DWORD low = GetCompressedFileSizeW(path.c_str(), &high);
+    if (low == INVALID_FILE_SIZE && GetLastError() != NO_ERROR)
+        return fallback;
+    return (static_cast<uint64_t>(high) << 32) | low;
+}
+#endif
+
+// follows symlinks, size, error and allocated (bytes on disk) are only filled in when asked for
+static inline bool fileIdOf(const fs::path& path, FileId& id, uint64_t* size = nullptr,
+                            std::error_code* error = nullptr, uint64_t* allocated = nullptr)
+{
+#ifdef _WIN32
+    HANDLE handle = CreateFileW(path.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+                                OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+    BY_HANDLE_FILE_INFORMATION info{};
+    if (handle == INVALID_HANDLE_VALUE || GetFileInformationByHandle(handle, &info) == 0)
+    {
+        if (error != nullptr)
+            *error = std::error_code(static_cast<int>(GetLastError()), std::system_category());
+        if (handle != INVALID_HANDLE_VALUE)
+            CloseHandle(handle);
+        return false;
+    }
+    CloseHandle(handle);
+
+    id.device = info.dwVolumeSerialNumber;
+    id.inode = (static_cast<uint64_t>(info.nFileIndexHigh) << 32) | info.nFileIndexLow;
+    const uint64_t fileSize = (static_cast<uint64_t>(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+    if (size != nullptr)
+        *size = fileSize;
+    if (allocated != nullptr)
+        *allocated = compressedSizeOf(path, fileSize);
+#else
+    struct stat st{};
+    if (::stat(path.c_str(), &st) != 0)
+    {
+        if (error != nullptr)
+            *error = std::error_code(errno, std::generic_category());
+        return false;
+    }
+
+    id.device = static_cast<uint64_t>(st.st_dev);
+    id.inode = static_cast<uint64_t>(st.st_ino);
+    if (size != nullptr)
+        *size = static_cast<uint64_t>(st.st_size);
+    if (allocated != nullptr)
+        *allocated = static_cast<uint64_t>(st.st_blocks) * 512;
+#endif
+    return true;
+}
+
+// size and bytes allocated on disk, which sparse files, compression or tail packing make
+// smaller; follows symlinks. The same single stat a plain file_size() would cost.
+static inline bool fileSizesOf(const fs::path& path, uint64_t& size, uint64_t& allocated, std::error_code& error)
+{
+#ifdef _WIN32
+    size = fs::file_size(path, error);
+    if (error)
+        return false;
+    allocated = compressedSizeOf(path, size);
+#else
+    struct stat st{};
+    if (::stat(path.c_str(), &st) != 0)
+    {
+        error = std::error_code(errno, std::generic_category());
+        return false;
+    }
+    size = static_cast<uint64_t>(st.st_size);
+    allocated = static_cast<uint64_t>(st.st_blocks) * 512;
+#endif
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------
+class VisitedSet
+{
+public:
+    // false when id was seen before
+    bool insert(const FileId& id)
+    {
+        return m_ids.insert(id).second;
+    }
+
+    size_t size() const { return m_ids.size(); }
+
+private:
+    std::unordered_set<FileId, FileIdHash> m_ids{};
+};
@@ -0,0 +1,431 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+    #include <psapi.h>
+#else
+    #include <sys/resource.h>
+    #include <time.h>
+#endif
+
+//--------------------------------------------------------------------------------------------
+// Process wide counters for --stats. Everything is a relaxed atomic, bumping a counter from a
+// hot loop costs about as much as a plain increment and never takes a lock.
+//--------------------------------------------------------------------------------------------
+using MetricCounter = std::atomic<uint64_t>;
+
+static inline uint64_t nowNanos()
+{
+    using namespace std::chrono;
+    return static_cast<uint64_t>(duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count());
+}
+
+//--------------------------------------------------------------------------------------------
+// Power of two buckets, bucket i holds values in [2^(i-1), 2^i), bucket 0 holds zeros
+class Log2Histogram
+{
+public:
+    static constexpr size_t NUM_BUCKETS = 65;
+
+    void record(uint64_t value)
+    {
+        size_t bucket = 0;
+        while (value != 0)
+        {
+            ++bucket;
+            value >>= 1;
+        }
+        m_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const
+    {
+        uint64_t total = 0;
+        for (const auto& b : m_buckets)
+            total += b.load(std::memory_order_relaxed);
+        return total;
+    }
+
+    // upper bound of the bucket holding the given percentile
+    uint64_t percentile(double pct) const
+    {
+        const uint64_t total = count();
+        if (total == 0)
+            return 0;
+
+        const auto target = static_cast<uint64_t>(total * pct / 100.0);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < NUM_BUCKETS; ++i)
+        {
+            seen += m_buckets[i].load(std::memory_order_relaxed);
+            if (seen > target)
+                return bucketLimit(i);
+        }
+        return bucketLimit(NUM_BUCKETS - 1);
+    }
+
+    template <typename Fn>
+    void forEachBucket(Fn fn) const
+    {
+        for (size_t i = 0; i < NUM_BUCKETS; ++i)
+        {
+            const uint64_t n = m_buckets[i].load(std::memory_order_relaxed);
+            if (n != 0)
+                fn(bucketLimit(i), n);
+        }
+    }
+
+private:
+    static uint64_t bucketLimit(size_t bucket)
+    {
+        return bucket == 0 ? 0 : (bucket >= 64 ? UINT64_MAX : (uint64_t{ 1 } << bucket) - 1);
+    }
+
+    std::array<MetricCounter, NUM_BUCKETS> m_buckets{};
+};
+
+//--------------------------------------------------------------------------------------------
+enum class Phase
+{
+    Traverse,
+    Group,
+    Content,
+    Output,
+    Count
+};
+
+enum class ContentStage
+{
+    Small,
+    Head,
+    Full,
+    Count
+};
+
+struct StageMetrics
+{
+    MetricCounter candidatesIn{};
+    MetricCounter survivors{};
+    MetricCounter filesRead{};
+    MetricCounter readErrors{};
+    MetricCounter bytesRead{};
+    MetricCounter holeBytes{};      // sparse file holes hashed without reading them
+    MetricCounter readNanos{};
+    MetricCounter hashNanos{};
+    Log2Histogram fileMicros{};
+};
+
+//--------------------------------------------------------------------------------------------
+class Metrics
+{
+public:
+    // traversal
+    MetricCounter dirs{};
+    MetricCounter files{};
+    MetricCounter statCalls{};
+    MetricCounter traverseErrors{};
+    MetricCounter matchedFiles{};
+    MetricCounter matchedBytes{};
+    MetricCounter matchedAllocated{};   // on disk, below matchedBytes for sparse files
+    Log2Histogram matchedFileSizes{};
+
+    // name/size grouping
+    MetricCounter groupingCandidates{};
+    MetricCounter candidateGroups{};
+
+    // content stages
+    std::array<StageMetrics, static_cast<size_t>(ContentStage::Count)> stages{};
+
+    // --max-read-mbps / --max-iops
+    MetricCounter throttleWaits{};
+    MetricCounter throttleNanos{};
+
+    // output
+    MetricCounter groupsWritten{};
+    MetricCounter bytesWritten{};
+
+    StageMetrics& stage(ContentStage s)
+    {
+        return stages[static_cast<size_t>(s)];
+    }
+
+    void beginPhase(Phase phase)
+    {
+        m_phaseStart[static_cast<size_t>(phase)] = nowNanos();
+    }
+
+    void endPhase(Phase phase)
+    {
+        const auto idx = static_cast<size_t>(phase);
+        m_phaseNanos[idx] += nowNanos() - m_phaseStart[idx];
+    }
+
+    //----------------------------------------------------------------------------------------
+    // Records wall and cpu time of the thread it lives on, cpu / wall is how busy the thread
+    // was versus blocked on I/O
+    class ThreadScope
+    {
+    public:
+        ThreadScope(Metrics& metrics, std::string name)
+            : m_metrics(metrics), m_name(std::move(name)), m_wallStart(nowNanos()), m_cpuStart(threadCpuNanos())
+        {
+        }
+
+        ~ThreadScope()
+        {
+            close();
+        }
+
+        void close()
+        {
+            if (m_closed)
+                return;
+            m_closed = true;
+            m_metrics.addThread(m_name, nowNanos() - m_wallStart, threadCpuNanos() - m_cpuStart);
+        }
+
+    private:
+        Metrics& m_metrics;
+        std::string m_name;
+        uint64_t m_wallStart;
+        uint64_t m_cpuStart;
+        bool m_closed{ false };
+    };
+
+    void writeText(std::ostream& out) const
+    {
+        const ProcessUsage usage = processUsage();
+        const double traverseSecs = phaseSecs(Phase::Traverse);
+
+        out << std::endl;
+        out << "Statistics" << std::endl;
+        out << "---------------------------------------" << std::endl;
+        out << std::fixed << std::setprecision(1);
+        out << "Phases (ms):    traverse " << phaseSecs(Phase::Traverse) * 1000
+            << ", group " << phaseSecs(Phase::Group) * 1000
+            << ", content " << phaseSecs(Phase::Content) * 1000
+            << ", output " << phaseSecs(Phase::Output) * 1000 << std::endl;
+        out << "Traversal:      " << load(dirs) << " dirs (" << perSec(load(dirs), traverseSecs) << "/s), "
+            << load(files) << " files (" << perSec(load(files), traverseSecs) << "/s), "
+            << load(statCalls) << " stat calls, " << load(traverseErrors) << " errors" << std::endl;
+        out << "Matched:        " << load(matchedFiles) << " files, " << load(matchedBytes) << " bytes, size p50 <= "
+            << matchedFileSizes.percentile(50) << ", p99 <= " << matchedFileSizes.percentile(99) << std::endl;
+        out << "Name/size:      " << load(matchedFiles) << " -> " << load(groupingCandidates) << " candidates in "
+            << load(candidateGroups) << " groups" << std::endl;
+
+        static const char* STAGE_NAMES[] = { "Small files:    ", "Head hash:      ", "Full hash:      " };
+        for (size_t i = 0; i < stages.size(); ++i)
+        {
+            const StageMetrics& s = stages[i];
+            const double readSecs = load(s.readNanos) / 1e9;
+            const double hashSecs = load(s.hashNanos) / 1e9;
+            out << STAGE_NAMES[i] << load(s.candidatesIn) << " -> " << load(s.survivors) << " candidates, "
+                << load(s.bytesRead) << " bytes read, " << load(s.holeBytes) << " in holes, read " << mbPerSec(load(s.bytesRead), readSecs)
+                << " MB/s, hash " << mbPerSec(load(s.bytesRead), hashSecs) << " MB/s, "
+                << load(s.readErrors) << " errors, per file p99 <= " << s.fileMicros.percentile(99) << " us" << std::endl;
+        }
+
+        out << "Throttled:      " << load(throttleNanos) / 1e6 << " ms in " << load(throttleWaits) << " waits" << std::endl;
+        out << "Output:         " << load(groupsWritten) << " groups, " << load(bytesWritten) << " bytes" << std::endl;
+        out << "Process:        peak rss " << usage.peakRssBytes / 1024 / 1024 << " MB, cpu user "
+            << usage.userSecs << " s, sys " << usage.sysSecs << " s, blocks in " << usage.blocksIn << std::endl;
+
+        std::lock_guard<std::mutex> lock(m_threadsLock);
+        for (const ThreadSample& t : m_threads)
+        {
+            out << "Thread " << std::left << std::setw(9) << (t.name + ":") << std::right
+                << t.wallNanos / 1e6 << " ms wall, " << t.cpuNanos / 1e6 << " ms cpu ("
+                << utilization(t) << "% busy)" << std::endl;
+        }
+        out << std::defaultfloat;
+    }
+
+    void writeJson(std::ostream& out) const
+    {
+        const ProcessUsage usage = processUsage();
+        const double traverseSecs = phaseSecs(Phase::Traverse);
+
+        out << std::fixed << std::setprecision(3);
+        out << "{\n";
+        out << "  \"phases_ms\": {\"traverse\": " << phaseSecs(Phase::Traverse) * 1000
+            << ", \"group\": " << phaseSecs(Phase::Group) * 1000
+            << ", \"content\": " << phaseSecs(Phase::Content) * 1000
+            << ", \"output\": " << phaseSecs(Phase::Output) * 1000 << "},\n";
+        out << "  \"traversal\": {\"dirs\": " << load(dirs) << ", \"files\": " << load(files)
+            << ", \"stat_calls\": " << load(statCalls)
+            << ", \"errors\": " << load(traverseErrors)
+            << ", \"dirs_per_sec\": " << perSec(load(dirs), traverseSecs)
+            << ", \"files_per_sec\": " << perSec(load(files), traverseSecs) << "},\n";
+        out << "  \"matched\": {\"files\": " << load(matchedFiles) << ", \"bytes\": " << load(matchedBytes)
+            << ", \"size_histogram\": ";
+        writeHistogram(out, matchedFileSizes);
+        out << "},\n";
+        out << "  \"grouping\": {\"candidates\": " << load(groupingCandidates)
+            << ", \"groups\": " << load(candidateGroups) << "},\n";
+
+        static const char* STAGE_NAMES[] = { "small_files", "head_hash", "full_hash" };
+        out << "  \"content\": {\n";
+        for (size_t i = 0; i < stages.size(); ++i)
+        {
+            const StageMetrics& s = stages[i];
+            out << "    \"" << STAGE_NAMES[i] << "\": {\"candidates_in\": " << load(s.candidatesIn)
+                << ", \"survivors\": " << load(s.survivors)
+                << ", \"files_read\": " << load(s.filesRead)
+                << ", \"read_errors\": " << load(s.readErrors)
+                << ", \"bytes_read\": " << load(s.bytesRead)
+                << ", \"hole_bytes\": " << load(s.holeBytes)
+                << ", \"read_ms\": " << load(s.readNanos) / 1e6
+                << ", \"hash_ms\": " << load(s.hashNanos) / 1e6
+                << ", \"hash_mb_per_sec\": " << mbPerSec(load(s.bytesRead), load(s.hashNanos) / 1e9)
+                << ", \"file_us_histogram\": ";
+            writeHistogram(out, s.fileMicros);
+            out << "}" << (i + 1 < stages.size() ? ",\n" : "\n");
+        }
+        out << "  },\n";
+        out << "  \"throttle\": {\"waits\": " << load(throttleWaits)
+            << ", \"wait_ms\": " << load(throttleNanos) / 1e6 << "},\n";
+        out << "  \"output\": {\"groups\": " << load(groupsWritten) << ", \"bytes\": " << load(bytesWritten) << "},\n";
+        out << "  \"process\": {\"peak_rss_bytes\": " << usage.peakRssBytes
+            << ", \"user_sec\": " << usage.userSecs << ", \"sys_sec\": " << usage.sysSecs
+            << ", \"blocks_in\": " << usage.blocksIn << "},\n";
+        out << "  \"threads\": [";
+
+        std::lock_guard<std::mutex> lock(m_threadsLock);
+        for (size_t i = 0; i < m_threads.size(); ++i)
+        {
+            const ThreadSample& t = m_threads[i];
+            out << (i == 0 ? "\n" : ",\n") << "    {\"name\": \"" << t.name << "\", \"wall_ms\": " << t.wallNanos / 1e6
+                << ", \"cpu_ms\": " << t.cpuNanos / 1e6 << ", \"busy_pct\": " << utilization(t) << "}";
+        }
+        out << "\n  ]\n";
+        out << "}" << std::endl;
+        out << std::defaultfloat;
+    }
+
+private:
+    struct ThreadSample
+    {
+        std::string name;
+        uint64_t wallNanos;
+        uint64_t cpuNanos;
+    };
+
+    struct ProcessUsage
+    {
+        uint64_t peakRssBytes{};
+        double userSecs{};
+        double sysSecs{};
+        uint64_t blocksIn{};
+    };
+
+    static uint64_t load(const MetricCounter& c)
+    {
+        return c.load(std::memory_order_relaxed);
+    }
+
+    static double perSec(uint64_t n, double secs)
+    {
+        return secs > 0 ? n / secs : 0.0;
+    }
+
+    static double mbPerSec(uint64_t bytes, double secs)
+    {
+        return secs > 0 ? bytes / 1024.0 / 1024.0 / secs : 0.0;
+    }
+
+    static double utilization(const ThreadSample& t)
+    {
+        return t.wallNanos > 0 ? 100.0 * t.cpuNanos / t.wallNanos : 0.0;
+    }
+
+    static void writeHistogram(std::ostream& out, const Log2Histogram& h)
+    {
+        out << "{";
+        bool first = true;
+        h.forEachBucket([&](uint64_t limit, uint64_t n)
+            {
+                out << (first ? "" : ", ") << "\"<=" << limit << "\": " << n;
+                first = false;
+            });
+        out << "}";
+    }
+
+    static uint64_t threadCpuNanos()
+    {
+#ifdef _WIN32
+        FILETIME creation, exit, kernel, user;
+        if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+            return 0;
+        auto toNanos = [](const FILETIME& ft) { return ((uint64_t{ ft.dwHighDateTime } << 32) | ft.dwLowDateTime) * 100; };
+        return toNanos(kernel) + toNanos(user);
+#else
+        timespec ts{};
+        if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+            return 0;
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + static_cast<uint64_t>(ts.tv_nsec);
+#endif
+    }
+
+    static ProcessUsage processUsage()
+    {
+        ProcessUsage usage{};
+#ifdef _WIN32
+        PROCESS_MEMORY_COUNTERS pmc{};
+        if (K32GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+            usage.peakRssBytes = pmc.PeakWorkingSetSize;
+
+        FILETIME creation, exit, kernel, user;
+        if (GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+        {
+            auto toSecs = [](const FILETIME& ft) { return ((uint64_t{ ft.dwHighDateTime } << 32) | ft.dwLowDateTime) / 1e7; };
+            usage.userSecs = toSecs(user);
+            usage.sysSecs = toSecs(kernel);
+        }
+#else
+        rusage ru{};
+        if (getrusage(RUSAGE_SELF, &ru) == 0)
+        {
+    #ifdef __APPLE__
+            usage.peakRssBytes = static_cast<uint64_t>(ru.ru_maxrss);
+    #else
+            usage.peakRssBytes = static_cast<uint64_t>(ru.ru_maxrss) * 1024;
+    #endif
+            usage.userSecs = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+            usage.sysSecs = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+            usage.blocksIn = static_cast<uint64_t>(ru.ru_inblock);
+        }
+#endif
+        return usage;
+    }
+
+    double phaseSecs(Phase phase) const
+    {
+        return m_phaseNanos[static_cast<size_t>(phase)] / 1e9;
+    }
+
+    void addThread(const std::string& name, uint64_t wallNanos, uint64_t cpuNanos)
+    {
+        std::lock_guard<std::mutex> lock(m_threadsLock);
+        m_threads.emplace_back(ThreadSample{ name, wallNanos, cpuNanos });
+    }
+
+    std::array<uint64_t, static_cast<size_t>(Phase::Count)> m_phaseStart{};
+    std::array<uint64_t, static_cast<size_t>(Phase::Count)> m_phaseNanos{};
+
+    mutable std::mutex m_threadsLock{};
+    std::vector<ThreadSample> m_threads{};
+};
+
+inline Metrics g_metrics{};
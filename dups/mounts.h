@@ -0,0 +1,208 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#ifndef _WIN32
+    #include <sys/stat.h>
+    #include <sys/types.h>
+#endif
+#ifdef __linux__
+    #include <sys/sysmacros.h>
+#endif
+
+#include "types.h"
+
+//--------------------------------------------------------------------------------------------
+// pseudo filesystems never hold anything worth comparing, they are skipped unless scanned
+// directly with -d
+static constexpr const char* DEFAULT_EXCLUDED_FSTYPES =
+    "proc,sysfs,devtmpfs,devpts,cgroup,cgroup2,debugfs,tracefs,securityfs,pstore,bpf,configfs,"
+    "mqueue,hugetlbfs,autofs,binfmt_misc,efivarfs,fusectl";
+
+//--------------------------------------------------------------------------------------------
+// Mount points by device and by absolute path, from /proc/self/mountinfo. Reading the table
+// never touches the mounts themselves.
+class MountTable
+{
+public:
+    struct MountPoint
+    {
+        uint64_t device;
+        std::string fsType;
+    };
+
+    bool load()
+    {
+#ifdef __linux__
+        std::ifstream mountInfo("/proc/self/mountinfo");
+        std::string line{};
+        while (std::getline(mountInfo, line))
+        {
+            // id parent major:minor root mount-point options [optional...] - fstype source super-options
+            std::istringstream fields(line);
+            std::string id, parent, majorMinor, root, mountPoint, field;
+            fields >> id >> parent >> majorMinor >> root >> mountPoint;
+
+            while (fields >> field && field != "-")
+                ;
+
+            std::string fsType{};
+            fields >> fsType;
+
+            unsigned major = 0, minor = 0;
+            if (fsType.empty() || std::sscanf(majorMinor.c_str(), "%u:%u", &major, &minor) != 2)
+                continue;
+
+            // later entries shadow earlier ones mounted on the same path, bind mounts share a device
+            const MountPoint mount{ static_cast<uint64_t>(makedev(major, minor)), fsType };
+            m_mounts[unescape(mountPoint)] = mount;
+            m_byDevice[mount.device] = mount;
+        }
+        return !m_mounts.empty();
+#else
+        return false;
+#endif
+    }
+
+    const MountPoint* find(const std::string& absolutePath) const
+    {
+        auto iter = m_mounts.find(absolutePath);
+        return iter == m_mounts.end() ? nullptr : &iter->second;
+    }
+
+    const MountPoint* findDevice(uint64_t device) const
+    {
+        auto iter = m_byDevice.find(device);
+        return iter == m_byDevice.end() ? nullptr : &iter->second;
+    }
+
+    bool empty() const { return m_mounts.empty(); }
+
+private:
+    // mountinfo writes space, tab, newline and backslash as \ooo
+    static std::string unescape(const std::string& str)
+    {
+        std::string result{};
+        for (size_t i = 0; i < str.size(); ++i)
+        {
+            if (str[i] == '\\' && i + 3 < str.size())
+            {
+                const std::string octal = str.substr(i + 1, 3);
+                if (octal.find_first_not_of("01234567") == std::string::npos)
+                {
+                    result += static_cast<char>(std::stoi(octal, nullptr, 8));
+                    i += 3;
+                    continue;
+                }
+            }
+            result += str[i];
+        }
+        return result;
+    }
+
+    std::unordered_map<std::string, MountPoint> m_mounts{};
+    std::unordered_map<uint64_t, MountPoint> m_byDevice{};
+};
+
+//--------------------------------------------------------------------------------------------
+// Decides which directories the walker must not enter: mount points of an excluded fstype and,
+// with --one-file-system, anything on a different st_dev than the root being walked. A
+// directory is a mount point when its st_dev differs from its parent's, so the common case
+// costs one stat and no path; the fstype then comes from the device, which also holds for
+// paths through symlinks (-L) that never show up in mountinfo.
+class MountBoundaries
+{
+public:
+    MountBoundaries(bool oneFileSystem, const std::string& excludedTypes)
+        : m_oneFileSystem(oneFileSystem)
+    {
+        std::istringstream types(excludedTypes);
+        std::string type{};
+        while (std::getline(types, type, ','))
+        {
+            if (!type.empty())
+                m_excluded.insert(type);
+        }
+
+        m_mounts.load();
+    }
+
+    bool active() const
+    {
+        return m_oneFileSystem || (!m_excluded.empty() && !m_mounts.empty());
+    }
+
+    // device is what --one-file-system compares against, 0 for the root's own; returns the
+    // root's own device, the parent device of its subdirectories
+    uint64_t enterRoot(const fs::path& root, uint64_t device = 0)
+    {
+        const uint64_t own = deviceOf(root, true);
+        m_rootDevice = device != 0 ? device : own;
+        return own;
+    }
+
+    // true when dir and everything below it has to be left out. parentDevice is the device of
+    // the directory holding dir, device gets dir's own. A link is only stat'ed through with
+    // follow, a link the walker won't enter stays on its parent's device.
+    bool skip(const fs::path& dir, uint64_t parentDevice, bool follow, uint64_t& device, std::ostream* verboseLog)
+    {
+        device = deviceOf(dir, follow);
+        if (device == parentDevice || device == 0)
+            return false;
+
+        // only at a device change, so rarely: by device first, then by path for the entries
+        // whose major:minor doesn't match st_dev
+        const MountTable::MountPoint* mount = m_mounts.findDevice(device);
+        if (mount == nullptr)
+        {
+            std::error_code ec{};
+            mount = m_mounts.find(fs::absolute(dir, ec).lexically_normal().string());
+        }
+
+        if (mount != nullptr && m_excluded.count(mount->fsType) != 0)
+            return skipped(dir, mount->fsType.c_str(), verboseLog);
+
+        // without a mount entry of its own: btrfs subvolumes e.g.
+        if (m_oneFileSystem && device != m_rootDevice)
+            return skipped(dir, mount != nullptr ? "other filesystem" : "other device", verboseLog);
+        return false;
+    }
+
+    uint64_t skippedCount() const { return m_skipped; }
+
+    static uint64_t deviceOf(const fs::path& path, bool follow)
+    {
+#ifndef _WIN32
+        struct stat st{};
+        if ((follow ? ::stat(path.c_str(), &st) : ::lstat(path.c_str(), &st)) == 0)
+            return static_cast<uint64_t>(st.st_dev);
+#else
+        (void)path;
+        (void)follow;
+#endif
+        return 0;
+    }
+
+private:
+
+    bool skipped(const fs::path& dir, const char* reason, std::ostream* verboseLog)
+    {
+        ++m_skipped;
+        if (verboseLog != nullptr)
+            *verboseLog << "Skipping " << dir.string() << " (" << reason << ")" << std::endl;
+        return true;
+    }
+
+    bool m_oneFileSystem;
+    std::unordered_set<std::string> m_excluded{};
+    MountTable m_mounts{};
+    uint64_t m_rootDevice{ 0 };
+    uint64_t m_skipped{ 0 };
+};
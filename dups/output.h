@@ -0,0 +1,372 @@
+#pragma once
+
+#include <charconv>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "types.h"
+
+//--------------------------------------------------------------------------------------------
+static inline double toMB(uint64_t sizeInBytes)
+{
+    return sizeInBytes / 1024.0 / 1024.0;
+}
+
+//--------------------------------------------------------------------------------------------
+// Write-behind buffer over a FILE*. Unlike std::endl it never flushes per line, output only
+// hits the stream when the buffer fills up or flush() is called explicitly.
+class BufferedWriter
+{
+public:
+    static constexpr size_t DEFAULT_CAPACITY = 1U << 20;
+
+    explicit BufferedWriter(FILE* out, size_t capacity = DEFAULT_CAPACITY)
+        : m_out(out)
+    {
+        m_buffer.reserve(capacity);
+    }
+
+    ~BufferedWriter()
+    {
+        flush();
+    }
+
+    BufferedWriter(const BufferedWriter&) = delete;
+    BufferedWriter& operator=(const BufferedWriter&) = delete;
+
+    void write(const char* data, size_t len)
+    {
+        if (m_buffer.size() + len > m_buffer.capacity())
+        {
+            flush();
+
+            // too big to be worth buffering, hand it over directly
+            if (len >= m_buffer.capacity())
+            {
+                writeThrough(data, len);
+                return;
+            }
+        }
+        m_buffer.insert(m_buffer.end(), data, data + len);
+    }
+
+    void write(std::string_view str)
+    {
+        write(str.data(), str.size());
+    }
+
+    void put(char c)
+    {
+        if (m_buffer.size() == m_buffer.capacity())
+            flush();
+        m_buffer.push_back(c);
+    }
+
+    void writeNumber(uint64_t value)
+    {
+        char digits[24];
+        auto res = std::to_chars(std::begin(digits), std::end(digits), value);
+        write(digits, static_cast<size_t>(res.ptr - digits));
+    }
+
+    void flush()
+    {
+        if (!m_buffer.empty())
+        {
+            writeThrough(m_buffer.data(), m_buffer.size());
+            m_buffer.clear();
+        }
+        if (m_out != nullptr)
+            std::fflush(m_out);
+    }
+
+    uint64_t bytesWritten() const
+    {
+        return m_bytesWritten;
+    }
+
+    // false once a write failed, e.g. the reading end of a pipe went away
+    bool good() const
+    {
+        return !m_failed;
+    }
+
+private:
+    void writeThrough(const char* data, size_t len)
+    {
+        if (m_out == nullptr || m_failed)
+            return;
+
+        if (std::fwrite(data, 1, len, m_out) != len)
+            m_failed = true;
+        else
+            m_bytesWritten += len;
+    }
+
+    FILE* m_out{ nullptr };
+    std::vector<char> m_buffer{};
+    bool m_failed{ false };
+    uint64_t m_bytesWritten{ 0 };
+};
+
+//--------------------------------------------------------------------------------------------
+enum class OutputFormat
+{
+    Text,       // human readable report, sorted by total size
+    JsonLines,  // one json object per group
+    Csv,        // group,size,path rows
+    Null        // NUL terminated paths, groups separated by an empty record
+};
+
+static inline OutputFormat outputFormatFromString(const std::string& str)
+{
+    if (str == "jsonl")
+        return OutputFormat::JsonLines;
+    else if (str == "csv")
+        return OutputFormat::Csv;
+    else if (str == "null")
+        return OutputFormat::Null;
+    else
+        return OutputFormat::Text;
+}
+
+//--------------------------------------------------------------------------------------------
+// Formats groups onto a BufferedWriter. Machine readable formats carry no banner or summary,
+// so they can be piped straight into another tool.
+class GroupWriter
+{
+public:
+    GroupWriter(OutputFormat format, BufferedWriter& out)
+        : m_format(format), m_out(out)
+    {
+    }
+
+    void writeHeader()
+    {
+        if (m_format == OutputFormat::Csv)
+            m_out.write("group,size,path\n");
+    }
+
+    void writeGroup(const NameBasedGroup& ng, const PathDetailsVec& allFiles)
+    {
+        const PathDetails& first = allFiles[ng.m_duplicates.at(0)];
+
+        // directory groups (--dirs) have paths with a trailing separator, titled "name/"
+        std::string name = first.m_path.filename().string();
+        if (name.empty() && first.m_path.has_parent_path())
+            name = first.m_path.parent_path().filename().string() + first.m_path.string().back();
+
+        writeGroup(name, first.m_size, ng.m_duplicates.size(),
+                   ng.m_totalSize, ng.m_hash,
+                   [&](size_t i) { return allFiles[ng.m_duplicates[i]].m_path.string(); });
+    }
+
+    // pathAt(i) yields something convertible to std::string_view for member i
+    template <typename PathAt>
+    void writeGroup(std::string_view name, uint64_t fileSize, size_t count, uint64_t totalSize,
+                    uint64_t hash, PathAt pathAt)
+    {
+        switch (m_format)
+        {
+        case OutputFormat::Text:
+            m_out.put('\n');
+            m_out.write(name);
+            m_out.put(' ');
+            m_out.writeNumber(fileSize);
+            m_out.write(" * ");
+            m_out.writeNumber(count);
+            m_out.write("\n---------------------------------------\n");
+
+            for (size_t i = 0; i < count; ++i)
+            {
+                m_out.write(pathAt(i));
+                m_out.put('\n');
+            }
+            break;
+
+        case OutputFormat::JsonLines:
+            m_out.write("{\"name\":");
+            writeJsonString(name);
+            m_out.write(",\"size\":");
+            m_out.writeNumber(fileSize);
+            m_out.write(",\"count\":");
+            m_out.writeNumber(count);
+            m_out.write(",\"total\":");
+            m_out.writeNumber(totalSize);
+            if (hash != 0)
+            {
+                m_out.write(",\"hash\":\"");
+                writeHex(hash);
+                m_out.put('"');
+            }
+            m_out.write(",\"paths\":[");
+
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (i != 0)
+                    m_out.put(',');
+                writeJsonString(pathAt(i));
+            }
+            m_out.write("]}\n");
+            break;
+
+        case OutputFormat::Csv:
+            for (size_t i = 0; i < count; ++i)
+            {
+                m_out.writeNumber(m_groupId);
+                m_out.put(',');
+                m_out.writeNumber(fileSize);
+                m_out.put(',');
+                writeCsvField(pathAt(i));
+                m_out.put('\n');
+            }
+            break;
+
+        case OutputFormat::Null:
+            for (size_t i = 0; i < count; ++i)
+            {
+                m_out.write(pathAt(i));
+                m_out.put('\0');
+            }
+            m_out.put('\0');
+            break;
+        }
+        ++m_groupId;
+    }
+
+    void writeSummary(uint64_t totalSize, uint64_t uniqSize)
+    {
+        writeSummary(totalSize, uniqSize, totalSize, uniqSize);
+    }
+
+    // the on disk lines only show up when sparse files (or compression) make them differ
+    void writeSummary(uint64_t totalSize, uint64_t uniqSize, uint64_t diskTotalSize, uint64_t diskUniqSize)
+    {
+        if (m_format != OutputFormat::Text)
+            return;
+
+        m_out.put('\n');
+        m_out.write("Size including duplicates: "); writeSizeAndMB(totalSize);
+        m_out.write("Size without duplicates:   "); writeSizeAndMB(uniqSize);
+        if (diskTotalSize != totalSize || diskUniqSize != uniqSize)
+        {
+            m_out.write("On disk including duplicates: "); writeSizeAndMB(diskTotalSize);
+            m_out.write("On disk without duplicates:   "); writeSizeAndMB(diskUniqSize);
+        }
+        m_out.put('\n');
+    }
+
+private:
+    // length of the well formed UTF-8 sequence starting at pos, 0 when there is none (stray
+    // continuation byte, truncated or overlong sequence, surrogate, beyond U+10FFFF)
+    static size_t utf8SequenceLength(std::string_view str, size_t pos)
+    {
+        const auto at = [&](size_t i) { return static_cast<unsigned char>(str[pos + i]); };
+        const unsigned char lead = at(0);
+
+        size_t len = 0;
+        unsigned char lo = 0x80, hi = 0xBF;     // allowed range of the second byte
+        if (lead >= 0xC2 && lead <= 0xDF)       len = 2;
+        else if (lead == 0xE0)                  { len = 3; lo = 0xA0; }
+        else if (lead == 0xED)                  { len = 3; hi = 0x9F; }
+        else if (lead >= 0xE1 && lead <= 0xEF)  len = 3;
+        else if (lead == 0xF0)                  { len = 4; lo = 0x90; }
+        else if (lead == 0xF4)                  { len = 4; hi = 0x8F; }
+        else if (lead >= 0xF1 && lead <= 0xF3)  len = 4;
+        else                                    return 0;
+
+        if (str.size() - pos < len || at(1) < lo || at(1) > hi)
+            return 0;
+        for (size_t i = 2; i < len; ++i)
+        {
+            if ((at(i) & 0xC0) != 0x80)
+                return 0;
+        }
+        return len;
+    }
+
+    // paths are bytes on linux, whatever isn't UTF-8 becomes U+FFFD so the line stays valid json
+    void writeJsonString(std::string_view str)
+    {
+        static const char HEX[] = "0123456789abcdef";
+        static const char REPLACEMENT[] = "\xEF\xBF\xBD";
+
+        m_out.put('"');
+        for (size_t i = 0; i < str.size();)
+        {
+            const char c = str[i];
+            const auto uc = static_cast<unsigned char>(c);
+            if (c == '"' || c == '\\')
+            {
+                m_out.put('\\');
+                m_out.put(c);
+            }
+            else if (uc < 0x20)
+            {
+                char esc[6] = { '\\', 'u', '0', '0', HEX[uc >> 4], HEX[uc & 0xF] };
+                m_out.write(esc, sizeof(esc));
+            }
+            else if (uc >= 0x80)
+            {
+                const size_t len = utf8SequenceLength(str, i);
+                if (len == 0)
+                {
+                    m_out.write(REPLACEMENT, sizeof(REPLACEMENT) - 1);
+                    ++i;
+                }
+                else
+                {
+                    m_out.write(str.data() + i, len);
+                    i += len;
+                }
+                continue;
+            }
+            else
+            {
+                m_out.put(c);
+            }
+            ++i;
+        }
+        m_out.put('"');
+    }
+
+    void writeCsvField(std::string_view str)
+    {
+        if (str.find_first_of(",\"\r\n") == std::string_view::npos)
+        {
+            m_out.write(str);
+            return;
+        }
+
+        m_out.put('"');
+        for (char c : str)
+        {
+            if (c == '"')
+                m_out.put('"');
+            m_out.put(c);
+        }
+        m_out.put('"');
+    }
+
+    void writeHex(uint64_t value)
+    {
+        char digits[16];
+        for (int i = 15; i >= 0; --i, value >>= 4)
+            digits[i] = "0123456789abcdef"[value & 0xF];
+        m_out.write(digits, sizeof(digits));
+    }
+
+    void writeSizeAndMB(uint64_t size)
+    {
+        char mb[32];
+        int len = std::snprintf(mb, sizeof(mb), " (%g MB)\n", toMB(size));
+        m_out.writeNumber(size);
+        m_out.write(mb, static_cast<size_t>(len));
+    }
+
+    OutputFormat m_format;
+    BufferedWriter& m_out;
+    uint64_t m_groupId{ 0 };
+};
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "arena.h"
+#include "types.h"
+
+//--------------------------------------------------------------------------------------------
+// Key extractors for the grouping pipeline. A method is a compile-time list of them, so every
+// method gets its own instantiation of the grouping loop which touches only the keys it needs.
+//
+// NameKey buckets files through a hash map, the remaining metadata keys split each bucket by
+// sorting on a tuple of their values. HeadHashKey and FullHashKey only mark that contents are
+// compared: reading files belongs to the per-device pools (content.h), not to this loop.
+//--------------------------------------------------------------------------------------------
+struct NameKey
+{
+    // the file name into key, which keeps its capacity between calls, so neither a temporary
+    // path nor a string is allocated per file
+    static void assign(const fs::path& path, std::pmr::string& key)
+    {
+#ifdef _WIN32
+        key.assign(path.filename().string());
+#else
+        const std::string& native = path.native();
+        const size_t slash = native.rfind('/');
+        key.assign(native, slash == std::string::npos ? 0 : slash + 1);
+#endif
+    }
+};
+
+struct SizeKey
+{
+    static uint64_t of(const PathDetails& pd) { return pd.m_size; }
+};
+
+struct HeadHashKey {};
+struct FullHashKey {};
+
+template <typename Key>
+struct IsMetadataKey : std::bool_constant<!std::is_same_v<Key, HeadHashKey> && !std::is_same_v<Key, FullHashKey>> {};
+
+//--------------------------------------------------------------------------------------------
+template <typename First, typename... Rest>
+struct KeyList
+{
+    static_assert(std::is_same_v<First, NameKey>, "groups are always bucketed by name first");
+
+    template <typename Key>
+    static constexpr bool has = (std::is_same_v<Key, Rest> || ...);
+
+    // content stages compare equally sized files only
+    static_assert(!has<HeadHashKey> || has<SizeKey>, "content keys need SizeKey before them");
+
+    static constexpr bool verifiesContent = has<FullHashKey>;
+
+    // 64 bit hash of the metadata keys, files which can end up in one group hash alike
+    static uint64_t sketchKey(const fs::path& path, uint64_t size)
+    {
+        uint64_t hash = std::hash<std::string>{}(path.filename().string());
+        if constexpr (has<SizeKey>)
+            hash ^= size + 0x9E3779B97F4A7C15ULL + (hash << 6) + (hash >> 2);
+
+        // splitmix64 finalizer, the sketch uses both halves
+        hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+        return hash ^ (hash >> 31);
+    }
+
+    // values of the metadata keys after the name, compared to split a name bucket
+    static auto splitKey(const PathDetails& pd)
+    {
+        return std::tuple_cat(splitKeyOf<Rest>(pd)...);
+    }
+
+private:
+    template <typename Key>
+    static auto splitKeyOf(const PathDetails& pd)
+    {
+        if constexpr (IsMetadataKey<Key>::value)
+            return std::make_tuple(Key::of(pd));
+        else
+            return std::tuple<>{};
+    }
+};
+
+using NameKeys            = KeyList<NameKey>;
+using NameSizeKeys        = KeyList<NameKey, SizeKey>;
+using NameSizeContentKeys = KeyList<NameKey, SizeKey, HeadHashKey, FullHashKey>;
+
+//--------------------------------------------------------------------------------------------
+// Calls onGroup(IndexVec&&) for every set of two or more files equal in all metadata keys.
+// Without keys after the name the bucket is the group and nothing is sorted.
+//
+// Group indices are allocated from groups. The name index is scratch: it lives in an arena of
+// its own on top of upstream and is dropped as a whole on return, not bucket by bucket.
+template <typename Keys, typename GroupFn>
+static inline void groupByKeys(const PathDetailsVec& allFiles, GroupFn&& onGroup,
+                               std::pmr::memory_resource* groups = std::pmr::get_default_resource(),
+                               std::pmr::memory_resource* upstream = std::pmr::new_delete_resource())
+{
+    PhaseArena index(upstream);
+    DuplicateFilesNames byName(index.resource());
+    byName.reserve(allFiles.size());
+    std::pmr::string name{};
+    for (size_t idx = 0; idx < allFiles.size(); ++idx)
+    {
+        NameKey::assign(allFiles[idx].m_path, name);
+        byName[name].emplace_back(idx);
+    }
+
+    using SplitKey = decltype(Keys::splitKey(std::declval<const PathDetails&>()));
+
+    std::pmr::vector<std::pair<SplitKey, size_t>> keyed(index.resource());
+    for (auto& bucket : byName)
+    {
+        IndexVec& indices = bucket.second;
+        if (indices.size() < 2)
+            continue;
+
+        if constexpr (std::tuple_size_v<SplitKey> == 0)
+        {
+            onGroup(IndexVec(indices, groups));
+        }
+        else
+        {
+            keyed.clear();
+            for (size_t idx : indices)
+                keyed.emplace_back(Keys::splitKey(allFiles[idx]), idx);
+            std::sort(std::begin(keyed), std::end(keyed));
+
+            for (size_t start = 0, end = 0; start < keyed.size(); start = end)
+            {
+                for (end = start + 1; end < keyed.size() && keyed[end].first == keyed[start].first; ++end)
+                    ;
+
+                if (end - start > 1)
+                {
+                    IndexVec split(groups);
+                    split.reserve(end - start);
+                    for (size_t i = start; i < end; ++i)
+                        split.emplace_back(keyed[i].second);
+                    onGroup(std::move(split));
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+
+#ifdef _WIN32
+    #include <io.h>
+#else
+    #include <unistd.h>
+#endif
+
+#include "metrics.h"
+
+//--------------------------------------------------------------------------------------------
+// Prints rates from g_metrics on a timer for --progress. The scanning threads never see this
+// class, they only bump the relaxed counters they bump anyway; all formatting and I/O happens
+// on the reporter thread. Goes to stderr so it never mixes with machine readable stdout.
+class ProgressReporter
+{
+public:
+    explicit ProgressReporter(std::chrono::milliseconds interval = std::chrono::milliseconds(1000))
+        : m_interval(interval)
+    {
+#ifdef _WIN32
+        m_isTty = _isatty(_fileno(stderr)) != 0;
+#else
+        m_isTty = isatty(fileno(stderr)) != 0;
+#endif
+    }
+
+    ~ProgressReporter()
+    {
+        stop();
+    }
+
+    void start()
+    {
+        m_phaseStart = nowNanos();
+        m_lastNanos = m_phaseStart;
+        m_thread = std::thread([this]() { run(); });
+    }
+
+    void stop()
+    {
+        if (!m_thread.joinable())
+            return;
+
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_stopping = true;
+        }
+        m_wakeup.notify_all();
+        m_thread.join();
+
+        if (m_isTty)
+            std::fprintf(stderr, "\r%-100s\r", "");
+    }
+
+    void setPhase(Phase phase)
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_phase = phase;
+        m_phaseStart = nowNanos();
+        m_lastNanos = m_phaseStart;
+        m_lastValue = 0;
+    }
+
+    // bytes the content stages will read at most, enables the ETA
+    void setContentBytesPlanned(uint64_t bytes)
+    {
+        m_contentBytesPlanned.store(bytes, std::memory_order_relaxed);
+    }
+
+private:
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+        while (!m_wakeup.wait_for(lock, m_interval, [this]() { return m_stopping; }))
+            report();
+    }
+
+    static uint64_t contentBytesRead()
+    {
+        uint64_t total = 0;
+        for (const StageMetrics& s : g_metrics.stages)
+            total += s.bytesRead.load(std::memory_order_relaxed);
+        return total;
+    }
+
+    // called with m_lock held
+    void report()
+    {
+        const uint64_t now = nowNanos();
+        const double elapsed = (now - m_phaseStart) / 1e9;
+        const double sinceLast = (now - m_lastNanos) / 1e9;
+        char line[256];
+
+        switch (m_phase)
+        {
+        case Phase::Traverse:
+        {
+            const uint64_t files = g_metrics.files.load(std::memory_order_relaxed);
+            const uint64_t dirs = g_metrics.dirs.load(std::memory_order_relaxed);
+            const double rate = sinceLast > 0 ? (files - m_lastValue) / sinceLast : 0.0;
+            m_lastValue = files;
+            std::snprintf(line, sizeof(line), "[traverse %5.0fs] %llu files, %llu dirs, %.0f files/s",
+                          elapsed, static_cast<unsigned long long>(files), static_cast<unsigned long long>(dirs), rate);
+            break;
+        }
+        case Phase::Group:
+            std::snprintf(line, sizeof(line), "[group    %5.0fs] %llu candidate groups",
+                          elapsed, static_cast<unsigned long long>(g_metrics.candidateGroups.load(std::memory_order_relaxed)));
+            break;
+        case Phase::Content:
+        {
+            const uint64_t bytes = contentBytesRead();
+            const uint64_t planned = m_contentBytesPlanned.load(std::memory_order_relaxed);
+            const double rate = sinceLast > 0 ? (bytes - m_lastValue) / sinceLast : 0.0;
+            const double avgRate = elapsed > 0 ? bytes / elapsed : 0.0;
+            m_lastValue = bytes;
+
+            int len = std::snprintf(line, sizeof(line), "[content  %5.0fs] %.1f MB hashed, %.1f MB/s",
+                                    elapsed, toMBytes(bytes), toMBytes(static_cast<uint64_t>(rate)));
+
+            // planned assumes every candidate is read in full, so this is an upper bound
+            if (planned > bytes && avgRate > 0 && len > 0)
+                std::snprintf(line + len, sizeof(line) - len, ", eta <= %.0fs", (planned - bytes) / avgRate);
+            break;
+        }
+        default:
+            std::snprintf(line, sizeof(line), "[output   %5.0fs] %llu groups",
+                          elapsed, static_cast<unsigned long long>(g_metrics.groupsWritten.load(std::memory_order_relaxed)));
+            break;
+        }
+
+        m_lastNanos = now;
+        if (m_isTty)
+            std::fprintf(stderr, "\r%-100s", line);
+        else
+            std::fprintf(stderr, "%s\n", line);
+        std::fflush(stderr);
+    }
+
+    static double toMBytes(uint64_t bytes)
+    {
+        return bytes / 1024.0 / 1024.0;
+    }
+
+    std::chrono::milliseconds m_interval;
+    bool m_isTty{ false };
+
+    std::thread m_thread{};
+    std::mutex m_lock{};
+    std::condition_variable m_wakeup{};
+    bool m_stopping{ false };
+
+    Phase m_phase{ Phase::Traverse };
+    uint64_t m_phaseStart{ 0 };
+    uint64_t m_lastNanos{ 0 };
+    uint64_t m_lastValue{ 0 };
+    std::atomic<uint64_t> m_contentBytesPlanned{ 0 };
+};
@@ -0,0 +1,1321 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <execution>
+#include <functional>
+#include <map>
+#include <numeric>
+#include <ostream>
+#include <regex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "arena.h"
+#include "checkpoint.h"
+#include "content.h"
+#include "device.h"
+#include "dirtree.h"
+#include "fileid.h"
+#include "glob.h"
+#include "metrics.h"
+#include "mounts.h"
+#include "pipeline.h"
+#include "sketch.h"
+#include "spill.h"
+#include "throttle.h"
+#include "types.h"
+
+//--------------------------------------------------------------------------------------------
+// Scanning as a library: the walker, name/size grouping, content verification and top K
+// selection behind Scanner, which streams every confirmed group to a callback. lsdups itself
+// is a front end to it that only formats what comes out.
+//--------------------------------------------------------------------------------------------
+using std::chrono::high_resolution_clock;
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+
+//--------------------------------------------------------------------------------------------
+// everything which decides what is found and how it is grouped
+struct ScanOptions
+{
+    enum class Method
+    {
+        Name,
+        NameSize,
+        NameSizeContent
+    };
+
+    std::string Directory{ "." };
+    std::string RefDirectory{};
+    std::string Pattern{ "*" };
+    std::string SkipPattern{};
+    Method GroupingMethod{ Method::NameSize };
+    uint64_t MinSize{ 0 };
+    uint64_t MinTotal{ 0 };
+    size_t TopK{ 0 };
+    bool Sorted{ false };           // deliver in canonical order instead of as found
+    uint64_t MemLimit{ 0 };
+    std::string SpillDir{};
+    std::string ExcludeFsTypes{ DEFAULT_EXCLUDED_FSTYPES };
+    bool OneFileSystem{ false };
+    bool FollowSymlinks{ false };
+    DeviceLimits IoThreads{ DeviceLimits::Defaults() };
+    CachePolicy ContentCache{ CachePolicy::Keep };  // what content reads leave in the page cache
+    uint64_t MaxReadBytesPerSec{ 0 };   // shared by traversal and content readers, 0 = unlimited
+    uint64_t MaxIops{ 0 };
+    bool HugePages{ false };        // back the grouping arenas with transparent huge pages
+    bool TwoPass{ false };          // walk twice, only keep files whose keys repeat
+    bool DirGroups{ false };        // report identical directories as one group, before the files
+    std::string CheckpointFile{};   // journal the scan here, so it can be resumed
+    uint32_t ShardIndex{ 0 };       // --shard i/N: only files whose name hashes to shard i
+    uint32_t ShardCount{ 0 };       // 0 = not sharded
+    bool Resume{ false };           // continue from CheckpointFile instead of starting over
+    std::ostream* VerboseLog{ nullptr };
+};
+
+//--------------------------------------------------------------------------------------------
+struct ScanStats
+{
+    size_t numFiles{};
+    size_t numDirs{};
+    size_t numSkippedMounts{};
+    size_t numRevisits{};
+    size_t numSingletons{};         // --two-pass matches never stored
+    size_t numResumed{};            // matches taken over from a checkpoint
+    size_t numOtherShards{};        // matches left to the other --shard runs
+    size_t numDirGroups{};          // --dirs groups found
+    size_t numDirCopyFiles{};       // files below their copies, not grouped on their own
+    size_t numErrors{};
+    long long timeMilliSecs{};
+
+    // counts by error, paths only up to MAX_ERROR_PATHS so a broken mount can't eat the memory
+    static constexpr size_t MAX_ERROR_PATHS = 32;
+    std::map<std::string, size_t> errorsByKind{};
+    std::vector<std::pair<std::string, std::string>> errorPaths{};
+
+    void recordError(const fs::path& path, const std::error_code& ec)
+    {
+        ++numErrors;
+        ++errorsByKind[ec.message()];
+        if (errorPaths.size() < MAX_ERROR_PATHS)
+            errorPaths.emplace_back(path.string(), ec.message());
+    }
+};
+
+//--------------------------------------------------------------------------------------------
+// invoked for every file passing pattern, skip pattern and size filters
+using MatchCallback = std::function<void(const fs::directory_entry&, uint64_t size, uint64_t allocated)>;
+
+//--------------------------------------------------------------------------------------------
+// -d and --ref take one or more directories, separated like PATH entries
+static inline PathVec splitRoots(const std::string& roots)
+{
+#ifdef _WIN32
+    const char separator = ';';
+#else
+    const char separator = ':';
+#endif
+
+    PathVec result{};
+    size_t start = 0;
+    while (start <= roots.size())
+    {
+        size_t end = roots.find(separator, start);
+        if (end == std::string::npos)
+            end = roots.size();
+
+        if (end > start)
+            result.emplace_back(roots.substr(start, end - start));
+        start = end + 1;
+    }
+    return result;
+}
+
+//--------------------------------------------------------------------------------------------
+// Shard of a file name. Every method groups by name first, so all members of a group land in
+// the same shard and each shard can group and verify on its own. XXH64 rather than std::hash,
+// shards may run as different builds on different hosts.
+static inline uint32_t shardOfName(const fs::path& name, uint32_t shardCount)
+{
+    constexpr uint64_t SHARD_SEED = 0x5348415244ULL;
+    const std::string str = name.string();
+    return static_cast<uint32_t>(ContentHasher::hash(str.data(), str.size(), SHARD_SEED) % shardCount);
+}
+
+// "i/N" with i < N
+static inline bool parseShard(const std::string& str, uint32_t& index, uint32_t& count)
+{
+    const size_t slash = str.find('/');
+    if (slash == std::string::npos)
+        return false;
+
+    try
+    {
+        size_t pos = 0;
+        const unsigned long i = std::stoul(str.substr(0, slash), &pos);
+        if (pos != slash)
+            return false;
+        const std::string countStr = str.substr(slash + 1);
+        const unsigned long n = std::stoul(countStr, &pos);
+        if (pos != countStr.size() || n == 0 || n > 65536 || i >= n)
+            return false;
+
+        index = static_cast<uint32_t>(i);
+        count = static_cast<uint32_t>(n);
+        return true;
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+}
+
+//--------------------------------------------------------------------------------------------
+// Walks the roots with an explicit stack of directory iterators and the error_code overloads
+// throughout: an unreadable directory, or one failing half way through (EIO, ESTALE, deleted
+// meanwhile) is recorded in travStats and the walk carries on with its siblings.
+// recursive_directory_iterator can't do that, any error while advancing ends the whole walk.
+// Setting cancel stops the walk at the next entry. countMatches is false for walks which only
+// prepare another one, so matched files and bytes are counted once. hooks let a walk pick up
+// where an interrupted one stopped (--resume), or follow what it lists (--watch).
+struct WalkHooks
+{
+    std::function<bool(const fs::path&)> skipDir{};     // already walked, neither entered nor counted
+    std::function<void(const fs::path&)> onDirDone{};   // the directory and all below it are walked
+    std::function<void(const fs::path&)> onEnterDir{};  // about to be listed, roots included
+    // the roots lie below a walk of this device (--watch following a directory moved in): -x
+    // compares against it and the roots are checked like any other directory, 0 = the roots'
+    uint64_t rootDevice{ 0 };
+};
+
+static inline void forEachMatchingFile(const ScanOptions& opts, const PathVec& roots, ScanStats& travStats,
+                                       const MatchCallback& onMatch, const std::atomic<bool>* cancel = nullptr,
+                                       bool countMatches = true, const WalkHooks* hooks = nullptr)
+{
+    const std::string& pattern = opts.Pattern;
+    const std::string& skipPattern = opts.SkipPattern;
+    std::ostream* verboseLog = opts.VerboseLog;
+
+    using dir_iter = fs::directory_iterator;
+    using dir_entry = fs::directory_entry;
+
+    auto t1 = high_resolution_clock::now();
+
+    std::string tweakedPattern = translate(pattern);
+    const auto regex = compile_pattern(tweakedPattern);
+
+    bool hasSkipPattern = !skipPattern.empty();
+    std::regex skipRegex{};
+    std::string tweakedSkipPattern{};
+
+    if (hasSkipPattern)
+    {
+        tweakedSkipPattern = translate(skipPattern);
+        skipRegex = compile_pattern(tweakedSkipPattern);
+    }
+
+    if (verboseLog != nullptr)
+    {
+        *verboseLog << "Input Pattern: " << pattern << std::endl;
+        *verboseLog << "Xlate Pattern: " << tweakedPattern << std::endl;
+
+        *verboseLog << "Skip Pattern:  " << skipPattern << std::endl;
+        *verboseLog << "Xlate Pattern: " << tweakedSkipPattern << std::endl;
+    }
+    
+    // mount points are checked before they are entered, so excluded subtrees are never read
+    MountBoundaries boundaries(opts.OneFileSystem, opts.ExcludeFsTypes);
+    const bool checkBoundaries = boundaries.active();
+
+    // following links can reach a directory or file more than once, or loop forever, so
+    // everything seen is remembered by (dev, inode)
+    const bool followSymlinks = opts.FollowSymlinks;
+    VisitedSet visitedDirs{};
+    VisitedSet visitedFiles{};
+
+    auto recordError = [&](const fs::path& path, const std::error_code& ec)
+    {
+        travStats.recordError(path, ec);
+        g_metrics.traverseErrors.fetch_add(1, std::memory_order_relaxed);
+    };
+
+    const bool sharded = opts.ShardCount > 1;
+    const bool skipDirs = hooks != nullptr && hooks->skipDir;
+    const bool trackDirs = hooks != nullptr && hooks->onDirDone;
+    const bool enterHook = hooks != nullptr && hooks->onEnterDir;
+
+    // paths of the directories on the stack, only kept for onDirDone, and their devices, only
+    // kept for the mount boundaries
+    std::vector<dir_iter> stack{};
+    std::vector<fs::path> stackPaths{};
+    std::vector<uint64_t> stackDevices{};
+    std::error_code ec{};
+
+    // a directory failing half way may still have a child to walk, it isn't reported as done
+    auto popDir = [&](bool done)
+    {
+        stack.pop_back();
+        if (checkBoundaries)
+            stackDevices.pop_back();
+        if (trackDirs)
+        {
+            if (done)
+                hooks->onDirDone(stackPaths.back());
+            stackPaths.pop_back();
+        }
+    };
+
+    for (const fs::path& root : roots)
+    {
+        const uint64_t rootDevice = hooks != nullptr ? hooks->rootDevice : 0;
+        uint64_t ownDevice = boundaries.enterRoot(root, rootDevice);
+        if (rootDevice != 0 && checkBoundaries &&
+            boundaries.skip(root, MountBoundaries::deviceOf(root.parent_path(), true), true, ownDevice, verboseLog))
+            continue;
+
+        FileId rootId{};
+        if (followSymlinks && fileIdOf(root, rootId) && !visitedDirs.insert(rootId))
+            continue;
+        if (skipDirs && hooks->skipDir(root))
+            continue;
+        if (enterHook)
+            hooks->onEnterDir(root);
+
+        stack.emplace_back(root, ec);
+        if (checkBoundaries)
+            stackDevices.emplace_back(ownDevice);
+        if (trackDirs)
+            stackPaths.emplace_back(root);
+        if (ec)
+        {
+            recordError(root, ec);
+            popDir(false);
+        }
+
+        while (!stack.empty())
+        {
+            if (cancel != nullptr && cancel->load(std::memory_order_relaxed))
+            {
+                stack.clear();
+                stackPaths.clear();
+                stackDevices.clear();
+                break;
+            }
+
+            dir_iter& iter = stack.back();
+            if (iter == dir_iter())
+            {
+                popDir(true);
+                continue;
+            }
+
+            const dir_entry dirEntry = *iter;
+            dir_iter child{};
+            uint64_t childDevice = 0;
+            bool descend = false;
+
+            if (dirEntry.is_regular_file(ec))
+            {
+                ++travStats.numFiles;
+                g_metrics.files.fetch_add(1, std::memory_order_relaxed);
+
+                const fs::path& path = dirEntry.path().filename();
+                bool matches = fnmatch_case(path, regex) && (!hasSkipPattern || !fnmatch_case(path, skipRegex));
+                if (matches && sharded && shardOfName(path, opts.ShardCount) != opts.ShardIndex)
+                {
+                    // some other shard's, not even stat'ed
+                    ++travStats.numOtherShards;
+                    matches = false;
+                }
+
+                if (matches)
+                {
+                    // small files never make it into the grouping at all
+                    uint64_t fileSize = 0;
+                    uint64_t allocated = 0;
+                    bool known = true;
+                    g_metrics.statCalls.fetch_add(1, std::memory_order_relaxed);
+                    g_ioThrottle.acquire(0);
+                    if (followSymlinks)
+                    {
+                        FileId fileId{};
+                        if (!fileIdOf(dirEntry.path(), fileId, &fileSize, &ec, &allocated))
+                        {
+                            recordError(dirEntry.path(), ec);
+                            known = false;
+                        }
+                        else if (!visitedFiles.insert(fileId))
+                        {
+                            ++travStats.numRevisits;
+                            known = false;
+                        }
+                    }
+                    else
+                    {
+                        if (!fileSizesOf(dirEntry.path(), fileSize, allocated, ec))
+                        {
+                            recordError(dirEntry.path(), ec);
+                            known = false;
+                        }
+                    }
+
+                    if (known && fileSize >= opts.MinSize)
+                    {
+                        onMatch(dirEntry, fileSize, allocated);
+                        if (countMatches)
+                        {
+                            g_metrics.matchedFiles.fetch_add(1, std::memory_order_relaxed);
+                            g_metrics.matchedBytes.fetch_add(fileSize, std::memory_order_relaxed);
+                            g_metrics.matchedAllocated.fetch_add(allocated, std::memory_order_relaxed);
+                            g_metrics.matchedFileSizes.record(fileSize);
+                        }
+                    }
+                }
+            }
+            else if (dirEntry.is_directory(ec))
+            {
+                FileId dirId{};
+                if (checkBoundaries &&
+                    boundaries.skip(dirEntry.path(), stackDevices.back(), followSymlinks, childDevice, verboseLog))
+                {
+                    // neither counted nor entered
+                }
+                else if (skipDirs && hooks->skipDir(dirEntry.path()))
+                {
+                    // walked before the run was interrupted
+                }
+                else if (!followSymlinks && dirEntry.is_symlink(ec))
+                {
+                    // counted, but only entered with --follow-symlinks
+                    ++travStats.numDirs;
+                    g_metrics.dirs.fetch_add(1, std::memory_order_relaxed);
+                }
+                else if (followSymlinks && (!fileIdOf(dirEntry.path(), dirId) || !visitedDirs.insert(dirId)))
+                {
+                    ++travStats.numRevisits;
+                }
+                else
+                {
+                    ++travStats.numDirs;
+                    g_metrics.dirs.fetch_add(1, std::memory_order_relaxed);
+
+                    if (enterHook)
+                        hooks->onEnterDir(dirEntry.path());
+                    g_ioThrottle.acquire(0);
+                    child = dir_iter(dirEntry.path(), ec);
+                    if (ec)
+                        recordError(dirEntry.path(), ec);
+                    else
+                        descend = true;
+                }
+            }
+
+            // moving on first, so the parent continues after this entry once the child is done;
+            // a failing parent ends at the error, its finished entries stay counted
+            iter.increment(ec);
+            if (ec)
+            {
+                recordError(dirEntry.path().parent_path(), ec);
+                popDir(false);
+            }
+
+            if (descend)
+            {
+                stack.emplace_back(std::move(child));
+                if (checkBoundaries)
+                    stackDevices.emplace_back(childDevice);
+                if (trackDirs)
+                    stackPaths.emplace_back(dirEntry.path());
+            }
+        }
+    }
+    travStats.numSkippedMounts += boundaries.skippedCount();
+
+    auto t2 = high_resolution_clock::now();
+    travStats.timeMilliSecs += duration_cast<milliseconds>(t2 - t1).count();
+}
+
+//--------------------------------------------------------------------------------------------
+static inline PathDetailsVec getAllMatchingFiles(const ScanOptions& opts, ScanStats& travStats,
+                                                 const std::atomic<bool>* cancel = nullptr)
+{
+    PathDetailsVec allFiles{};
+    allFiles.reserve(100);
+
+    forEachMatchingFile(opts, splitRoots(opts.Directory), travStats,
+        [&](const fs::directory_entry& entry, uint64_t fileSize, uint64_t allocated)
+        {
+            allFiles.emplace_back(PathDetails{ entry, fileSize, allocated });
+        },
+        cancel);
+
+    return allFiles;
+}
+
+//--------------------------------------------------------------------------------------------
+// --two-pass: the first walk only logs key hashes, which then go into a SingletonSketch sized
+// for exactly that many, the second walk keeps full records for keys seen more than once.
+// Memory follows the candidates instead of the tree, at the cost of listing every directory
+// twice. Files appearing in between are treated like singletons.
+template <typename Keys>
+static inline bool getRepeatedMatchingFiles(const ScanOptions& opts, ScanStats& travStats, PathDetailsVec& allFiles,
+                                            std::string& error, const std::atomic<bool>* cancel = nullptr)
+{
+    const PathVec roots = splitRoots(opts.Directory);
+
+    // the log's file goes before its directory does
+    SpillDirectory scratch{};
+    KeyHashLog keyHashes{};
+    std::error_code ec{};
+    const fs::path scratchParent = opts.SpillDir.empty() ? fs::temp_directory_path(ec) : fs::path(opts.SpillDir);
+    if (!scratch.create(scratchParent, error) || !keyHashes.open(scratch.path() / "keys", error))
+        return false;
+
+    // errors and counts come from the second walk, only the time of the first one adds up
+    ScanStats sketchStats{};
+    forEachMatchingFile(opts, roots, sketchStats,
+        [&](const fs::directory_entry& entry, uint64_t fileSize, uint64_t)
+        {
+            keyHashes.add(Keys::sketchKey(entry.path(), fileSize));
+        },
+        cancel, false);
+    travStats.timeMilliSecs += sketchStats.timeMilliSecs;
+
+    SingletonSketch sketch(sketchCapacity(keyHashes.count()));
+    if (!keyHashes.forEach([&](uint64_t hash) { sketch.add(hash); }, error))
+        return false;
+
+    forEachMatchingFile(opts, roots, travStats,
+        [&](const fs::directory_entry& entry, uint64_t fileSize, uint64_t allocated)
+        {
+            if (sketch.repeated(Keys::sketchKey(entry.path(), fileSize)))
+                allFiles.emplace_back(PathDetails{ entry, fileSize, allocated });
+            else
+                ++travStats.numSingletons;
+        },
+        cancel);
+
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------
+// Reference files first, then only the candidates sharing name and size (only the name when
+// matchSize is false) with one of them, so candidates which can't match never take up memory.
+// Indices below refCount are references.
+static inline PathDetailsVec getCrossSetFiles(const ScanOptions& opts, ScanStats& travStats, bool matchSize,
+                                              size_t& refCount, const std::atomic<bool>* cancel = nullptr)
+{
+    PathDetailsVec allFiles{};
+    allFiles.reserve(100);
+
+    forEachMatchingFile(opts, splitRoots(opts.RefDirectory), travStats,
+        [&](const fs::directory_entry& entry, uint64_t fileSize, uint64_t allocated)
+        {
+            allFiles.emplace_back(PathDetails{ entry, fileSize, allocated });
+        },
+        cancel);
+    refCount = allFiles.size();
+
+    PhaseArena indexArena(arenaUpstream(opts.HugePages));
+    DuplicateFilesNames refIndex(indexArena.resource());
+    std::pmr::string name{};
+    for (size_t idx = 0; idx < refCount; ++idx)
+    {
+        NameKey::assign(allFiles[idx].m_path, name);
+        refIndex[name].emplace_back(idx);
+    }
+
+    forEachMatchingFile(opts, splitRoots(opts.Directory), travStats,
+        [&](const fs::directory_entry& entry, uint64_t fileSize, uint64_t allocated)
+        {
+            NameKey::assign(entry.path(), name);
+            auto iter = refIndex.find(name);
+            if (iter == refIndex.end())
+                return;
+
+            for (size_t idx : iter->second)
+            {
+                if (!matchSize || allFiles[idx].m_size == fileSize)
+                {
+                    allFiles.emplace_back(PathDetails{ entry, fileSize, allocated });
+                    return;
+                }
+            }
+        },
+        cancel);
+
+    return allFiles;
+}
+
+//--------------------------------------------------------------------------------------------
+static inline uint64_t getTotalSize(const IndexVec& indices, const PathDetailsVec& allFiles)
+{
+    uint64_t totalSize = 0U;
+
+    for (const auto& idx : indices)
+        totalSize += allFiles[idx].m_size;
+
+    return totalSize;
+}
+
+
+//--------------------------------------------------------------------------------------------
+// with reference files (refCount != 0) only groups holding a reference and a candidate count
+static inline bool isCrossSetGroup(const IndexVec& indices, size_t refCount)
+{
+    if (refCount == 0)
+        return true;
+
+    bool hasRef = false, hasCandidate = false;
+    for (size_t idx : indices)
+    {
+        hasRef |= idx < refCount;
+        hasCandidate |= idx >= refCount;
+    }
+    return hasRef && hasCandidate;
+}
+
+//--------------------------------------------------------------------------------------------
+// invoked for every group as soon as it is finalized
+using GroupCallback = std::function<void(const NameBasedGroup&)>;
+
+//--------------------------------------------------------------------------------------------
+// a group together with the files its indices refer to, for groups which outlive their spill partition
+struct SpilledGroup
+{
+    NameBasedGroup m_group;
+    PathDetailsVec m_files;
+};
+
+// copies only the members, so a kept group costs its own paths and not its partition's
+static inline SpilledGroup detachGroup(const NameBasedGroup& ng, const PathDetailsVec& files)
+{
+    SpilledGroup detached{ NameBasedGroup{ {}, ng.m_totalSize, ng.m_hash }, {} };
+    detached.m_files.reserve(ng.m_duplicates.size());
+    detached.m_group.m_duplicates.reserve(ng.m_duplicates.size());
+    for (size_t idx : ng.m_duplicates)
+    {
+        detached.m_group.m_duplicates.emplace_back(detached.m_files.size());
+        detached.m_files.emplace_back(files[idx]);
+    }
+    return detached;
+}
+
+//--------------------------------------------------------------------------------------------
+// Canonical report order, independent of traversal order, hash map iteration and threads:
+// members by path, groups largest total first and ties by their first path. Paths compare as
+// native strings, byte by byte.
+static inline bool pathBefore(const PathDetailsVec& files, size_t first, size_t second)
+{
+    return files[first].m_path.native() < files[second].m_path.native();
+}
+
+static inline void sortMembers(IndexVec& members, const PathDetailsVec& files)
+{
+    std::sort(std::begin(members), std::end(members),
+        [&](size_t first, size_t second) { return pathBefore(files, first, second); });
+}
+
+static inline const NameBasedGroup& groupOf(const NameBasedGroup& ng) { return ng; }
+static inline const NameBasedGroup& groupOf(const SpilledGroup& sg) { return sg.m_group; }
+static inline NameBasedGroup& groupOf(NameBasedGroup& ng) { return ng; }
+static inline NameBasedGroup& groupOf(SpilledGroup& sg) { return sg.m_group; }
+
+// spilled groups bring their own files, everything else indexes allFiles
+static inline const PathDetailsVec& filesOf(const NameBasedGroup&, const PathDetailsVec& allFiles) { return allFiles; }
+static inline const PathDetailsVec& filesOf(const SpilledGroup& sg, const PathDetailsVec&) { return sg.m_files; }
+
+//--------------------------------------------------------------------------------------------
+// Collects groups in canonical order. With a limit only that many are kept in a min-heap, so
+// neither memory nor the final sort grow with the number of groups found; ties at the cut are
+// decided by path as well, so the same K groups survive every run.
+template <typename Group>
+class LargestGroups
+{
+public:
+    LargestGroups(size_t limit, const PathDetailsVec& allFiles)
+        : m_limit(limit), m_allFiles(allFiles)
+    {
+    }
+
+    void add(Group&& group)
+    {
+        sortMembers(groupOf(group).m_duplicates, filesOf(group, m_allFiles));
+
+        auto before = [this](const Group& first, const Group& second) { return canonicalBefore(first, second); };
+
+        if (m_limit == 0)
+        {
+            m_groups.emplace_back(std::move(group));
+        }
+        else if (m_groups.size() < m_limit)
+        {
+            m_groups.emplace_back(std::move(group));
+            std::push_heap(std::begin(m_groups), std::end(m_groups), before);
+        }
+        else if (canonicalBefore(group, m_groups.front()))
+        {
+            std::pop_heap(std::begin(m_groups), std::end(m_groups), before);
+            m_groups.back() = std::move(group);
+            std::push_heap(std::begin(m_groups), std::end(m_groups), before);
+        }
+    }
+
+    // sorts (total, first path) keys in parallel, then moves every group once into place
+    std::vector<Group> take()
+    {
+        struct SortKey
+        {
+            uint64_t totalSize;
+            const std::string* firstPath;
+            size_t index;
+        };
+
+        std::vector<SortKey> keys{};
+        keys.reserve(m_groups.size());
+        for (size_t i = 0; i < m_groups.size(); ++i)
+            keys.emplace_back(SortKey{ groupOf(m_groups[i]).m_totalSize, &firstPathOf(m_groups[i]), i });
+
+        std::sort(std::execution::par, std::begin(keys), std::end(keys),
+            [](const SortKey& first, const SortKey& second)
+            {
+                if (first.totalSize != second.totalSize)
+                    return first.totalSize > second.totalSize;
+                return *first.firstPath < *second.firstPath;
+            });
+
+        std::vector<Group> sorted{};
+        sorted.reserve(m_groups.size());
+        for (const SortKey& key : keys)
+            sorted.emplace_back(std::move(m_groups[key.index]));
+
+        m_groups.clear();
+        return sorted;
+    }
+
+private:
+    const std::string& firstPathOf(const Group& group) const
+    {
+        return filesOf(group, m_allFiles)[groupOf(group).m_duplicates.at(0)].m_path.native();
+    }
+
+    bool canonicalBefore(const Group& first, const Group& second) const
+    {
+        const uint64_t firstTotal = groupOf(first).m_totalSize;
+        const uint64_t secondTotal = groupOf(second).m_totalSize;
+        if (firstTotal != secondTotal)
+            return firstTotal > secondTotal;
+        return firstPathOf(first) < firstPathOf(second);
+    }
+
+    size_t m_limit;
+    const PathDetailsVec& m_allFiles;
+    std::vector<Group> m_groups{};
+};
+
+//--------------------------------------------------------------------------------------------
+// with a callback, groups are handed over as they are found and not kept, topK is only
+// honoured when groups are collected. Keys picks the metadata the files are grouped by.
+// Group indices come from arena when given, which then has to outlive the groups.
+template <typename Keys>
+static inline NameBasedGroupVec filterAndGroupFiles(const PathDetailsVec& allFiles, long long& timeMilliSec,
+                                                    uint64_t minTotal, size_t topK, size_t refCount,
+                                                    const GroupCallback& onGroup = {}, PhaseArena* arena = nullptr)
+{
+    auto t1 = high_resolution_clock::now();
+    LargestGroups<NameBasedGroup> grouping(topK, allFiles);
+
+    std::pmr::memory_resource* groups = arena != nullptr ? arena->resource() : std::pmr::get_default_resource();
+    std::pmr::memory_resource* upstream = arena != nullptr ? arena->upstream() : std::pmr::new_delete_resource();
+    groupByKeys<Keys>(allFiles,
+        [&](IndexVec&& idxVec)
+        {
+            NameBasedGroup ng{ std::move(idxVec), 0 };
+            ng.m_totalSize = getTotalSize(ng.m_duplicates, allFiles);
+            if (ng.m_totalSize < minTotal || !isCrossSetGroup(ng.m_duplicates, refCount))
+                return;
+
+            g_metrics.candidateGroups.fetch_add(1, std::memory_order_relaxed);
+            g_metrics.groupingCandidates.fetch_add(ng.m_duplicates.size(), std::memory_order_relaxed);
+
+            if (onGroup)
+                onGroup(ng);
+            else
+                grouping.add(std::move(ng));
+        },
+        groups, upstream);
+
+    NameBasedGroupVec sorted = grouping.take();
+
+    auto t2 = high_resolution_clock::now();
+    timeMilliSec = duration_cast<milliseconds>(t2 - t1).count();
+    return sorted;
+}
+
+//--------------------------------------------------------------------------------------------
+static inline NameBasedGroupVec verifyContents(const NameBasedGroupVec& grouping, const PathDetailsVec& allFiles,
+                                               uint64_t minTotal, size_t topK, size_t refCount,
+                                               const DeviceLimits& ioThreads, CachePolicy cachePolicy,
+                                               long long& timeMilliSec,
+                                               const std::atomic<bool>* cancel = nullptr)
+{
+    auto t1 = high_resolution_clock::now();
+    LargestGroups<NameBasedGroup> verified(topK, allFiles);
+
+    refineOnDevicePools(grouping, allFiles, ioThreads, cachePolicy,
+        [&](NameBasedGroup&& sameContent)
+        {
+            if (sameContent.m_totalSize >= minTotal && isCrossSetGroup(sameContent.m_duplicates, refCount))
+                verified.add(std::move(sameContent));
+        },
+        cancel);
+
+    NameBasedGroupVec sorted = verified.take();
+
+    auto t2 = high_resolution_clock::now();
+    timeMilliSec = duration_cast<milliseconds>(t2 - t1).count();
+    return sorted;
+}
+
+//--------------------------------------------------------------------------------------------
+// invoked for every name/size group found in the spilled records, indices refer to files
+using SpilledGroupCallback = std::function<void(const NameBasedGroup&, const PathDetailsVec&)>;
+
+//--------------------------------------------------------------------------------------------
+// --mem-limit counterpart of filterAndGroupFiles, groups one partition at a time so only the
+// largest partition (or budget sized runs of it) is ever held in memory
+template <typename Keys>
+static inline bool groupSpilledFiles(const SpillPartitioner& partitioner, size_t memLimit, uint64_t minTotal,
+                                     long long& timeMilliSec, const SpilledGroupCallback& onGroup, std::string& error,
+                                     const std::atomic<bool>* cancel = nullptr)
+{
+    auto t1 = high_resolution_clock::now();
+
+    for (const fs::path& partition : partitioner.partitions())
+    {
+        if (cancel != nullptr && cancel->load(std::memory_order_relaxed))
+            break;
+
+        const bool ok = groupSpillPartition(partition, memLimit, Keys::template has<SizeKey>,
+            [&](PathDetailsVec&& files)
+            {
+                IndexVec idxVec(files.size());
+                std::iota(std::begin(idxVec), std::end(idxVec), size_t{ 0 });
+
+                NameBasedGroup ng{ std::move(idxVec), 0 };
+                ng.m_totalSize = getTotalSize(ng.m_duplicates, files);
+                if (ng.m_totalSize < minTotal)
+                    return;
+
+                g_metrics.candidateGroups.fetch_add(1, std::memory_order_relaxed);
+                g_metrics.groupingCandidates.fetch_add(ng.m_duplicates.size(), std::memory_order_relaxed);
+                onGroup(ng, files);
+            },
+            error);
+
+        if (!ok)
+            return false;
+
+        // done with it, give the disk space back right away
+        std::error_code ec{};
+        fs::remove(partition, ec);
+    }
+
+    auto t2 = high_resolution_clock::now();
+    timeMilliSec = duration_cast<milliseconds>(t2 - t1).count();
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------
+// calls run with the key list of method, so each method gets its own instantiation of run
+template <typename Run>
+static inline auto withMethodKeys(ScanOptions::Method method, Run&& run)
+{
+    switch (method)
+    {
+    case ScanOptions::Method::Name:            return run(NameKeys{});
+    case ScanOptions::Method::NameSizeContent: return run(NameSizeContentKeys{});
+    default:                                   return run(NameSizeKeys{});
+    }
+}
+
+//--------------------------------------------------------------------------------------------
+// What decides the file table and the candidates. A checkpoint only resumes a scan which agrees
+// on all of it, shards only merge with shards of the same scan; result filters like
+// --min-total or --top may differ.
+static inline uint64_t scanFingerprint(const ScanOptions& opts, bool withShard)
+{
+    std::string key = opts.Directory + '\n' + opts.Pattern + '\n' + opts.SkipPattern + '\n' +
+                      std::to_string(static_cast<int>(opts.GroupingMethod)) + '\n' +
+                      std::to_string(opts.MinSize) + '\n' + opts.ExcludeFsTypes + '\n' +
+                      (opts.OneFileSystem ? "x" : "") + (opts.FollowSymlinks ? "L" : "") +
+                      (opts.DirGroups ? "D" : "");
+    if (withShard && opts.ShardCount != 0)
+        key += '\n' + std::to_string(opts.ShardIndex) + '/' + std::to_string(opts.ShardCount);
+    return ContentHasher::hash(key.data(), key.size());
+}
+
+// Answers a content candidate from a checkpoint, false when it wasn't verified before the
+// interruption. Recorded members are matched back to the candidate by path.
+static inline bool replayVerified(const Checkpoint& checkpoint, const NameBasedGroup& candidate,
+                                  const PathDetailsVec& allFiles, const ContentGroupCallback& onSameContent)
+{
+    const PathDetails& first = allFiles[candidate.m_duplicates.at(0)];
+    const std::vector<Checkpoint::VerifiedGroup>* groups =
+        checkpoint.verified(first.m_path.filename().string(), first.m_size);
+    if (groups == nullptr)
+        return false;
+
+    std::unordered_map<std::string, size_t> members{};
+    for (size_t idx : candidate.m_duplicates)
+        members.emplace(allFiles[idx].m_path.string(), idx);
+
+    for (const Checkpoint::VerifiedGroup& group : *groups)
+    {
+        NameBasedGroup ng{ {}, 0, group.hash };
+        for (const std::string& path : group.paths)
+        {
+            const auto it = members.find(path);
+            if (it != members.end())
+                ng.m_duplicates.emplace_back(it->second);
+        }
+
+        if (ng.m_duplicates.size() > 1)
+        {
+            ng.m_totalSize = first.m_size * ng.m_duplicates.size();
+            onSameContent(std::move(ng));
+        }
+    }
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------
+// One scan from options to confirmed groups. Groups are handed to onGroup as soon as they are
+// final: while grouping when streaming, or after the last one in canonical order with Sorted
+// or a TopK (--mem-limit then keeps a copy of the reported groups' members until the end).
+// Group indices refer to the files passed along, both are only valid during the call.
+// onGroup may be called from any thread, streamed nsc groups come from the content workers,
+// but calls are serialized and all of them have returned when run() does.
+//
+// cancel() may be called from any thread (or a signal handler), run() then stops at the next
+// directory entry, group or partition and returns false with "cancelled".
+class Scanner
+{
+public:
+    using GroupFn = std::function<void(const NameBasedGroup&, const PathDetailsVec&)>;
+
+    // all optional, unlike onGroup always called on the thread running run()
+    struct Events
+    {
+        std::function<void(Phase)> onPhase{};
+        std::function<void(const ScanStats&, const PathDetailsVec&)> onTraversed{};
+        std::function<void(size_t groups, uint64_t bytes, long long ms)> onCandidates{};
+        std::function<void(size_t groups, long long ms)> onVerified{};
+        std::function<void(const ScanStats&, long long ms)> onDirectories{};
+    };
+
+    explicit Scanner(const ScanOptions& opts)
+        : m_opts(opts)
+    {
+    }
+
+    Scanner(const ScanOptions& opts, Events events)
+        : m_opts(opts), m_events(std::move(events))
+    {
+    }
+
+    bool run(const GroupFn& onGroup, std::string& error)
+    {
+        if (m_opts.MemLimit != 0 && !m_opts.RefDirectory.empty())
+        {
+            error = "--ref can't be combined with --mem-limit";
+            return false;
+        }
+        if (m_opts.Resume && m_opts.CheckpointFile.empty())
+        {
+            error = "--resume needs --checkpoint";
+            return false;
+        }
+        if (!m_opts.CheckpointFile.empty() && (m_opts.MemLimit != 0 || m_opts.TwoPass || !m_opts.RefDirectory.empty()))
+        {
+            error = "--checkpoint can't be combined with --mem-limit, --two-pass or --ref";
+            return false;
+        }
+        if (m_opts.DirGroups && (m_opts.MemLimit != 0 || m_opts.TwoPass || !m_opts.RefDirectory.empty() || m_opts.ShardCount != 0))
+        {
+            // all of them leave some of a directory's files out of allFiles
+            error = "--dirs can't be combined with --mem-limit, --two-pass, --ref or --shard";
+            return false;
+        }
+
+        g_ioThrottle.configure(m_opts.MaxReadBytesPerSec, m_opts.MaxIops);
+        const bool ok = withMethodKeys(m_opts.GroupingMethod,
+            [&](auto keys) { return runWith<decltype(keys)>(onGroup, error); });
+
+        if (ok && cancelled())
+        {
+            error = "cancelled";
+            return false;
+        }
+        return ok;
+    }
+
+    void cancel() { m_cancel.store(true, std::memory_order_relaxed); }
+    bool cancelled() const { return m_cancel.load(std::memory_order_relaxed); }
+
+    // grouping and verification run in one pass, groups are delivered as found unless they
+    // have to come in canonical order (--mem-limit with Sorted or a top K)
+    bool streams() const
+    {
+        return m_opts.MemLimit != 0 || (!m_opts.Sorted && m_opts.TopK == 0);
+    }
+
+    // groups reach onGroup while the scan is still going, in no particular order
+    bool deliversAsFound() const
+    {
+        return !m_opts.Sorted && m_opts.TopK == 0;
+    }
+
+    const ScanStats& stats() const { return m_stats; }
+
+    // time spent grouping and verifying, output included when streaming
+    long long groupMilliSecs() const { return m_groupMilliSecs; }
+
+private:
+    template <typename Keys>
+    bool runWith(const GroupFn& onGroup, std::string& error)
+    {
+        constexpr bool verifyContent = Keys::verifiesContent;
+
+        // with a memory limit matches go straight to disk partitions instead of allFiles
+        const bool spillToDisk = m_opts.MemLimit != 0;
+        const size_t memLimit = static_cast<size_t>(std::max<uint64_t>(m_opts.MemLimit, 1U << 20));
+        SpillDirectory spillDir{};
+        SpillPartitioner partitioner{};
+        if (spillToDisk)
+        {
+            std::error_code ec{};
+            const fs::path spillParent = m_opts.SpillDir.empty() ? fs::temp_directory_path(ec) : fs::path(m_opts.SpillDir);
+            if (!spillDir.create(spillParent, error) || !partitioner.open(spillDir.path(), memLimit, error))
+                return false;
+        }
+
+        // journals files, walked directories and verified candidates, a resumed scan starts
+        // with whatever the interrupted one had
+        const bool checkpointing = !m_opts.CheckpointFile.empty();
+        Checkpoint checkpoint{};
+
+        g_metrics.beginPhase(Phase::Traverse);
+        PathDetailsVec allFiles{};
+        size_t refCount = 0;
+        if (checkpointing)
+        {
+            if (!checkpoint.open(m_opts.CheckpointFile, scanFingerprint(m_opts, true), m_opts.Resume, allFiles, error))
+                return false;
+
+            m_stats.numResumed = allFiles.size();
+            for (const PathDetails& pd : allFiles)
+            {
+                g_metrics.matchedFiles.fetch_add(1, std::memory_order_relaxed);
+                g_metrics.matchedBytes.fetch_add(pd.m_size, std::memory_order_relaxed);
+                g_metrics.matchedAllocated.fetch_add(pd.m_allocated, std::memory_order_relaxed);
+                g_metrics.matchedFileSizes.record(pd.m_size);
+            }
+
+            if (!checkpoint.traversed())
+            {
+                WalkHooks hooks{};
+                hooks.skipDir = [&](const fs::path& dir) { return checkpoint.dirDone(dir); };
+                hooks.onDirDone = [&](const fs::path& dir) { checkpoint.addDirDone(dir); };
+
+                forEachMatchingFile(m_opts, splitRoots(m_opts.Directory), m_stats,
+                    [&](const fs::directory_entry& entry, uint64_t fileSize, uint64_t allocated)
+                    {
+                        allFiles.emplace_back(PathDetails{ entry, fileSize, allocated });
+                        checkpoint.addFile(entry.path(), fileSize, allocated);
+                    },
+                    &m_cancel, true, &hooks);
+
+                if (!cancelled())
+                    checkpoint.addTraversed();
+            }
+        }
+        else if (spillToDisk)
+        {
+            forEachMatchingFile(m_opts, splitRoots(m_opts.Directory), m_stats,
+                [&](const fs::directory_entry& entry, uint64_t fileSize, uint64_t allocated)
+                {
+                    partitioner.add(entry.path(), fileSize, allocated);
+                },
+                &m_cancel);
+
+            if (!partitioner.finish())
+            {
+                error = "unable to write spill files to " + spillDir.path().string();
+                return false;
+            }
+        }
+        else if (!m_opts.RefDirectory.empty())
+        {
+            allFiles = getCrossSetFiles(m_opts, m_stats, Keys::template has<SizeKey>, refCount, &m_cancel);
+        }
+        else if (m_opts.TwoPass)
+        {
+            if (!getRepeatedMatchingFiles<Keys>(m_opts, m_stats, allFiles, error, &m_cancel))
+            {
+                g_metrics.endPhase(Phase::Traverse);
+                return false;
+            }
+        }
+        else
+        {
+            allFiles = getAllMatchingFiles(m_opts, m_stats, &m_cancel);
+        }
+        g_metrics.endPhase(Phase::Traverse);
+
+        if (m_events.onTraversed)
+            m_events.onTraversed(m_stats, allFiles);
+        if (cancelled())
+            return true;
+
+        // whole directories first, the files below all but one copy of each then sit out the
+        // file groups. Candidates are verified without the checkpoint, it journals by name/size
+        // group and these are only part of one.
+        DirectoryGroups dirGroups{};
+        if (m_opts.DirGroups)
+        {
+            phase(Phase::Group);
+            g_metrics.beginPhase(Phase::Group);
+            auto t1 = high_resolution_clock::now();
+            dirGroups = findDuplicateDirectories<Keys>(allFiles, splitRoots(m_opts.Directory), m_opts.MinTotal,
+                [&](const NameBasedGroupVec& candidates, const PathDetailsVec& files, const ContentGroupCallback& onSameContent)
+                {
+                    refineOnDevicePools(candidates, files, m_opts.IoThreads, m_opts.ContentCache, onSameContent, &m_cancel);
+                });
+            const long long dirMilliSecs = duration_cast<milliseconds>(high_resolution_clock::now() - t1).count();
+            g_metrics.endPhase(Phase::Group);
+
+            m_stats.numDirGroups = dirGroups.groups.size();
+            m_stats.numDirCopyFiles = dirGroups.filesDropped;
+            if (m_events.onDirectories)
+                m_events.onDirectories(m_stats, dirMilliSecs);
+            if (cancelled())
+                return true;
+        }
+
+        // --top counts directory groups on their own
+        auto emitDirGroups = [&]()
+        {
+            const size_t count = m_opts.TopK == 0 ? dirGroups.groups.size() : std::min(m_opts.TopK, dirGroups.groups.size());
+            for (size_t g = 0; g < count && !cancelled(); ++g)
+                onGroup(dirGroups.groups[g], dirGroups.dirs);
+        };
+
+        auto keep = [&](const NameBasedGroup& sameContent)
+        {
+            return sameContent.m_totalSize >= m_opts.MinTotal && isCrossSetGroup(sameContent.m_duplicates, refCount);
+        };
+
+        // content candidates the checkpoint has answers for are replayed from it, the rest go
+        // to the device pools and are journaled as they finish
+        auto refineCandidates = [&](const NameBasedGroupVec& candidates, const ContentGroupCallback& onSameContent)
+        {
+            if (!checkpointing)
+            {
+                refineOnDevicePools(candidates, allFiles, m_opts.IoThreads, m_opts.ContentCache, onSameContent,
+                                    &m_cancel);
+                return;
+            }
+
+            NameBasedGroupVec pending{};
+            for (const NameBasedGroup& candidate : candidates)
+            {
+                if (!replayVerified(checkpoint, candidate, allFiles, onSameContent))
+                    pending.emplace_back(candidate);
+            }
+
+            refineOnDevicePools(pending, allFiles, m_opts.IoThreads, m_opts.ContentCache, onSameContent, &m_cancel,
+                [&](const NameBasedGroup& candidate, const NameBasedGroupVec& sameContent)
+                {
+                    checkpoint.addVerified(candidate, sameContent, allFiles);
+                });
+        };
+
+        // the upper bound of what the content stage reads, feeds the progress ETA
+        auto announceCandidates = [&](const NameBasedGroupVec& candidates)
+        {
+            if (!m_events.onCandidates)
+                return;
+            uint64_t candidateBytes = 0;
+            for (const NameBasedGroup& ng : candidates)
+                candidateBytes += ng.m_totalSize;
+            m_events.onCandidates(candidates.size(), candidateBytes, m_groupMilliSecs);
+        };
+
+        // name/size candidates live until the last group is delivered and go in one piece
+        PhaseArena groupArena(arenaUpstream(m_opts.HugePages));
+
+        if (!streams())
+        {
+            // contents can only shrink a group, so the top K has to wait for verification
+            const size_t nameSizeTopK = verifyContent ? 0 : m_opts.TopK;
+            phase(Phase::Group);
+            g_metrics.beginPhase(Phase::Group);
+            NameBasedGroupVec grouping = filterAndGroupFiles<Keys>(allFiles, m_groupMilliSecs, m_opts.MinTotal,
+                                                                   nameSizeTopK, refCount, {}, &groupArena);
+            g_metrics.endPhase(Phase::Group);
+
+            announceCandidates(grouping);
+
+            if constexpr (verifyContent)
+            {
+                phase(Phase::Content);
+                g_metrics.beginPhase(Phase::Content);
+                auto t1 = high_resolution_clock::now();
+                LargestGroups<NameBasedGroup> verified(m_opts.TopK, allFiles);
+                refineCandidates(grouping,
+                    [&](NameBasedGroup&& sameContent)
+                    {
+                        if (keep(sameContent))
+                            verified.add(std::move(sameContent));
+                    });
+                grouping = verified.take();
+                m_groupMilliSecs = duration_cast<milliseconds>(high_resolution_clock::now() - t1).count();
+                g_metrics.endPhase(Phase::Content);
+
+                if (m_events.onVerified)
+                    m_events.onVerified(grouping.size(), m_groupMilliSecs);
+            }
+
+            phase(Phase::Output);
+            emitDirGroups();
+            for (const NameBasedGroup& ng : grouping)
+            {
+                if (cancelled())
+                    break;
+                onGroup(ng, allFiles);
+            }
+
+            if (checkpointing && !cancelled())
+                checkpoint.remove();
+            return true;
+        }
+
+        // streamed groups are verified and delivered from inside the grouping, so the group
+        // phase includes the content phase here. Only spilled groups can get here in canonical
+        // order (Sorted or a top K), those keep a copy of their members until the end.
+        const bool ordered = m_opts.Sorted || m_opts.TopK != 0;
+        LargestGroups<SpilledGroup> largest(m_opts.TopK, allFiles);
+        auto keepOrEmit = [&](const NameBasedGroup& ng, const PathDetailsVec& files)
+        {
+            if (cancelled())
+                return;
+            if (!ordered)
+                onGroup(ng, files);
+            else
+                largest.add(detachGroup(ng, files));
+        };
+
+        FileMemBuffer buffer{};
+        auto refineAndEmit = [&](const NameBasedGroup& ng, const PathDetailsVec& files)
+        {
+            if constexpr (!verifyContent)
+            {
+                keepOrEmit(ng, files);
+            }
+            else
+            {
+                g_metrics.beginPhase(Phase::Content);
+                NameBasedGroupVec sameContentGroups{};
+                refineByContent(ng, files, m_opts.ContentCache, buffer,
+                    [&](NameBasedGroup&& sameContent)
+                    {
+                        if (keep(sameContent))
+                            sameContentGroups.emplace_back(std::move(sameContent));
+                    });
+                g_metrics.endPhase(Phase::Content);
+
+                for (const NameBasedGroup& sameContent : sameContentGroups)
+                    keepOrEmit(sameContent, files);
+            }
+        };
+
+        emitDirGroups();
+
+        phase(verifyContent ? Phase::Content : Phase::Group);
+        g_metrics.beginPhase(Phase::Group);
+        if (spillToDisk)
+        {
+            if (!groupSpilledFiles<Keys>(partitioner, memLimit, m_opts.MinTotal, m_groupMilliSecs, refineAndEmit,
+                                         error, &m_cancel))
+            {
+                g_metrics.endPhase(Phase::Group);
+                return false;
+            }
+        }
+        else if constexpr (verifyContent)
+        {
+            // the device pools need the whole candidate list up front, verified groups are
+            // still delivered as soon as they are found
+            NameBasedGroupVec grouping = filterAndGroupFiles<Keys>(allFiles, m_groupMilliSecs, m_opts.MinTotal, 0,
+                                                                   refCount, {}, &groupArena);
+            announceCandidates(grouping);
+            g_metrics.beginPhase(Phase::Content);
+            refineCandidates(grouping,
+                [&](NameBasedGroup&& sameContent)
+                {
+                    if (keep(sameContent))
+                        keepOrEmit(sameContent, allFiles);
+                });
+            g_metrics.endPhase(Phase::Content);
+        }
+        else
+        {
+            filterAndGroupFiles<Keys>(allFiles, m_groupMilliSecs, m_opts.MinTotal, 0, refCount,
+                [&](const NameBasedGroup& ng) { keepOrEmit(ng, allFiles); }, &groupArena);
+        }
+        g_metrics.endPhase(Phase::Group);
+
+        // collected groups get their status line and the output phase before them, as they do
+        // without --mem-limit
+        const std::vector<SpilledGroup> kept = largest.take();
+        if (ordered)
+        {
+            if (m_events.onCandidates)
+            {
+                uint64_t keptBytes = 0;
+                for (const SpilledGroup& sg : kept)
+                    keptBytes += sg.m_group.m_totalSize;
+                m_events.onCandidates(kept.size(), keptBytes, m_groupMilliSecs);
+            }
+            phase(Phase::Output);
+        }
+
+        for (const SpilledGroup& sg : kept)
+        {
+            if (cancelled())
+                break;
+            onGroup(sg.m_group, sg.m_files);
+        }
+
+        if (checkpointing && !cancelled())
+            checkpoint.remove();
+        return true;
+    }
+
+    void phase(Phase next)
+    {
+        if (m_events.onPhase)
+            m_events.onPhase(next);
+    }
+
+    ScanOptions m_opts;
+    Events m_events{};
+    ScanStats m_stats{};
+    long long m_groupMilliSecs{ 0 };
+    std::atomic<bool> m_cancel{ false };
+};
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "types.h"
+
+//--------------------------------------------------------------------------------------------
+// Blocked Bloom filter: every key sets all of its bits inside one 64 byte block, so a lookup
+// costs a single cache miss. ~10 bits per expected key keep false positives around 1%.
+class BlockedBloomFilter
+{
+public:
+    explicit BlockedBloomFilter(uint64_t expectedKeys)
+        : m_blocks(static_cast<size_t>(std::max<uint64_t>(1, expectedKeys * BITS_PER_KEY / BLOCK_BITS)))
+    {
+    }
+
+    // true when all bits were set already, i.e. the key was probably inserted before
+    bool insert(uint64_t hash)
+    {
+        Block& block = m_blocks[blockIndex(hash)];
+        bool present = true;
+        forEachBit(hash, [&](size_t word, uint64_t mask)
+        {
+            present = present && (block.words[word] & mask) != 0;
+            block.words[word] |= mask;
+        });
+        return present;
+    }
+
+    bool contains(uint64_t hash) const
+    {
+        const Block& block = m_blocks[blockIndex(hash)];
+        bool present = true;
+        forEachBit(hash, [&](size_t word, uint64_t mask) { present = present && (block.words[word] & mask) != 0; });
+        return present;
+    }
+
+    size_t bytes() const { return m_blocks.size() * sizeof(Block); }
+
+private:
+    static constexpr uint64_t BITS_PER_KEY = 10;
+    static constexpr uint64_t BLOCK_BITS = 512;
+    static constexpr unsigned PROBES = 7;
+
+    struct alignas(64) Block
+    {
+        uint64_t words[BLOCK_BITS / 64]{};
+    };
+
+    // high half of the hash picks the block (multiply-shift instead of a modulo), the low
+    // half drives double hashing inside of it
+    size_t blockIndex(uint64_t hash) const
+    {
+        return static_cast<size_t>(((hash >> 32) * m_blocks.size()) >> 32);
+    }
+
+    template <typename BitFn>
+    static void forEachBit(uint64_t hash, BitFn&& onBit)
+    {
+        const uint32_t h1 = static_cast<uint32_t>(hash);
+        const uint32_t h2 = (h1 >> 17) | (h1 << 15) | 1U;
+        for (unsigned i = 0; i < PROBES; ++i)
+        {
+            const uint32_t bit = (h1 + i * h2) % BLOCK_BITS;
+            onBit(bit / 64, uint64_t{ 1 } << (bit % 64));
+        }
+    }
+
+    std::vector<Block> m_blocks;
+};
+
+//--------------------------------------------------------------------------------------------
+// Answers "was this key seen more than once" without storing keys: a second filter only gets
+// keys the first one already had. Never misses a repeated key, lets about 1% of the unique
+// ones through, which grouping drops later anyway.
+class SingletonSketch
+{
+public:
+    explicit SingletonSketch(uint64_t expectedKeys)
+        : m_once(expectedKeys), m_twice(expectedKeys / 2 + 1)
+    {
+    }
+
+    void add(uint64_t hash)
+    {
+        if (m_once.insert(hash))
+            m_twice.insert(hash);
+    }
+
+    bool repeated(uint64_t hash) const { return m_twice.contains(hash); }
+
+    size_t bytes() const { return m_once.bytes() + m_twice.bytes(); }
+
+private:
+    BlockedBloomFilter m_once;
+    BlockedBloomFilter m_twice;
+};
+
+//--------------------------------------------------------------------------------------------
+// Key hashes of the first --two-pass walk, kept in a scratch file until the walk is over so
+// the sketch can be sized from the exact count: 8 bytes per match on disk, one buffer in memory.
+class KeyHashLog
+{
+public:
+    KeyHashLog() = default;
+    KeyHashLog(const KeyHashLog&) = delete;
+    KeyHashLog& operator=(const KeyHashLog&) = delete;
+
+    ~KeyHashLog()
+    {
+        if (m_file != nullptr)
+            std::fclose(m_file);
+    }
+
+    bool open(const fs::path& path, std::string& error)
+    {
+        m_file = std::fopen(path.string().c_str(), "w+b");
+        if (m_file == nullptr)
+        {
+            error = "unable to create " + path.string() + ": " + std::strerror(errno);
+            return false;
+        }
+        m_buffer.reserve(BUFFER_KEYS);
+        return true;
+    }
+
+    void add(uint64_t hash)
+    {
+        m_buffer.push_back(hash);
+        ++m_count;
+        if (m_buffer.size() == BUFFER_KEYS)
+            flush();
+    }
+
+    uint64_t count() const { return m_count; }
+
+    // every hash added, in order; false if the file couldn't be written or read back
+    template <typename HashFn>
+    bool forEach(HashFn&& onHash, std::string& error)
+    {
+        flush();
+        if (m_failed || std::fflush(m_file) != 0 || std::fseek(m_file, 0, SEEK_SET) != 0)
+        {
+            error = "unable to write the --two-pass key hashes";
+            return false;
+        }
+
+        uint64_t left = m_count;
+        while (left != 0)
+        {
+            m_buffer.resize(static_cast<size_t>(std::min<uint64_t>(left, BUFFER_KEYS)));
+            if (std::fread(m_buffer.data(), sizeof(uint64_t), m_buffer.size(), m_file) != m_buffer.size())
+            {
+                error = "unable to read back the --two-pass key hashes";
+                return false;
+            }
+            for (uint64_t hash : m_buffer)
+                onHash(hash);
+            left -= m_buffer.size();
+        }
+        m_buffer.clear();
+        return true;
+    }
+
+private:
+    static constexpr size_t BUFFER_KEYS = 1U << 16;
+
+    void flush()
+    {
+        if (!m_buffer.empty() && std::fwrite(m_buffer.data(), sizeof(uint64_t), m_buffer.size(), m_file) != m_buffer.size())
+            m_failed = true;
+        m_buffer.clear();
+    }
+
+    FILE* m_file{ nullptr };
+    std::vector<uint64_t> m_buffer{};
+    uint64_t m_count{ 0 };
+    bool m_failed{ false };
+};
+
+// Sketch size for a known number of keys. Capped, so a huge tree can't claim more than
+// 256 MiB for both filters together; past the cap false positives grow beyond 1%, which only
+// keeps more unique files for the second walk.
+static inline uint64_t sketchCapacity(uint64_t keys)
+{
+    constexpr uint64_t MIN_KEYS = 1U << 10;
+    constexpr uint64_t MAX_KEYS = uint64_t{ 1 } << 27;
+    return std::clamp(keys, MIN_KEYS, MAX_KEYS);
+}
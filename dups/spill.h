@@ -0,0 +1,522 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifdef _WIN32
+    #include <process.h>
+    #include <stdio.h>
+#else
+    #include <sys/resource.h>
+    #include <unistd.h>
+#endif
+
+#include "content.h"
+#include "output.h"
+#include "types.h"
+
+//--------------------------------------------------------------------------------------------
+// External name/size grouping for --mem-limit. Traversal appends one compact record per
+// matching file to one of SPILL_PARTITIONS run files, chosen by the hash of the file name, so
+// every name/size group lives entirely inside one partition. Partitions are then grouped one at
+// a time: in memory when they fit the budget, otherwise by sorting budget sized runs and k-way
+// merging them.
+//
+// Record layout: SpillRecordHeader followed by pathLen bytes of path (no terminator).
+//--------------------------------------------------------------------------------------------
+static constexpr size_t SPILL_PARTITIONS = 256;
+
+struct SpillRecordHeader
+{
+    uint64_t keyHash;       // hash of the file name
+    uint64_t size;
+    uint64_t allocated;     // bytes on disk
+    uint32_t pathLen;
+    uint32_t nameOffset;    // file name starts here inside the path
+};
+
+static_assert(sizeof(SpillRecordHeader) == 32, "SpillRecordHeader layout changed");
+
+//--------------------------------------------------------------------------------------------
+// read only view over a serialized record
+class SpillRecord
+{
+public:
+    explicit SpillRecord(const char* data)
+    {
+        std::memcpy(&m_header, data, sizeof(m_header));
+        m_path = data + sizeof(m_header);
+    }
+
+    uint64_t keyHash() const { return m_header.keyHash; }
+    uint64_t size() const { return m_header.size; }
+    uint64_t allocated() const { return m_header.allocated; }
+    std::string_view path() const { return std::string_view(m_path, m_header.pathLen); }
+    std::string_view name() const { return path().substr(m_header.nameOffset); }
+
+    // same order within every partition: name hash, the name itself, then size. Equal names
+    // stay adjacent whether or not sizes are part of the key.
+    bool operator<(const SpillRecord& other) const
+    {
+        if (keyHash() != other.keyHash())
+            return keyHash() < other.keyHash();
+        if (name() != other.name())
+            return name() < other.name();
+        return size() < other.size();
+    }
+
+    bool sameKey(const SpillRecord& other, bool compareSize) const
+    {
+        return keyHash() == other.keyHash() && name() == other.name() && (!compareSize || size() == other.size());
+    }
+
+private:
+    SpillRecordHeader m_header{};
+    const char* m_path{ nullptr };
+};
+
+//--------------------------------------------------------------------------------------------
+// Unique scratch directory, removed with everything in it on destruction
+class SpillDirectory
+{
+public:
+    bool create(const fs::path& parent, std::string& error)
+    {
+#ifdef _WIN32
+        const auto pid = _getpid();
+#else
+        const auto pid = getpid();
+#endif
+        const auto stamp = std::chrono::steady_clock::now().time_since_epoch().count();
+        m_path = parent / ("lsdups-spill-" + std::to_string(pid) + "-" + std::to_string(stamp));
+
+        std::error_code ec{};
+        if (!fs::create_directories(m_path, ec))
+        {
+            error = "unable to create spill directory " + m_path.string() + ": " + ec.message();
+            m_path.clear();
+            return false;
+        }
+        return true;
+    }
+
+    ~SpillDirectory()
+    {
+        if (!m_path.empty())
+        {
+            std::error_code ec{};
+            fs::remove_all(m_path, ec);
+        }
+    }
+
+    const fs::path& path() const { return m_path; }
+
+private:
+    fs::path m_path{};
+};
+
+//--------------------------------------------------------------------------------------------
+class SpillWriter
+{
+public:
+    bool open(const fs::path& path, size_t bufferBytes)
+    {
+        m_file = std::fopen(path.string().c_str(), "wb");
+        if (m_file == nullptr)
+            return false;
+        m_out = std::make_unique<BufferedWriter>(m_file, bufferBytes);
+        return true;
+    }
+
+    SpillWriter() = default;
+    SpillWriter(const SpillWriter&) = delete;
+    SpillWriter& operator=(const SpillWriter&) = delete;
+
+    ~SpillWriter()
+    {
+        close();
+    }
+
+    void write(const char* record, size_t len)
+    {
+        m_out->write(record, len);
+    }
+
+    void write(const SpillRecordHeader& header, std::string_view path)
+    {
+        m_out->write(reinterpret_cast<const char*>(&header), sizeof(header));
+        m_out->write(path);
+    }
+
+    bool close()
+    {
+        if (m_file == nullptr)
+            return true;
+
+        m_out->flush();
+        bool ok = m_out->good();
+        m_out.reset();
+        ok = std::fclose(m_file) == 0 && ok;
+        m_file = nullptr;
+        return ok;
+    }
+
+private:
+    FILE* m_file{ nullptr };
+    std::unique_ptr<BufferedWriter> m_out{};
+};
+
+//--------------------------------------------------------------------------------------------
+class SpillReader
+{
+public:
+    bool open(const fs::path& path, size_t bufferBytes)
+    {
+        m_file = std::fopen(path.string().c_str(), "rb");
+        if (m_file == nullptr)
+            return false;
+
+        m_buffer.resize(std::max<size_t>(bufferBytes, 4096));
+        std::setvbuf(m_file, m_buffer.data(), _IOFBF, m_buffer.size());
+        return true;
+    }
+
+    SpillReader() = default;
+    SpillReader(const SpillReader&) = delete;
+    SpillReader& operator=(const SpillReader&) = delete;
+
+    ~SpillReader()
+    {
+        if (m_file != nullptr)
+            std::fclose(m_file);
+    }
+
+    // replaces record with the next serialized record, false at the end or on an error
+    bool next(std::string& record)
+    {
+        SpillRecordHeader header{};
+        const size_t got = std::fread(&header, 1, sizeof(header), m_file);
+        if (got != sizeof(header))
+        {
+            // a clean end falls exactly between two records
+            m_failed = got != 0 || std::ferror(m_file) != 0;
+            return false;
+        }
+
+        record.resize(sizeof(header) + header.pathLen);
+        std::memcpy(&record[0], &header, sizeof(header));
+        if (header.pathLen != 0 && std::fread(&record[sizeof(header)], header.pathLen, 1, m_file) != 1)
+        {
+            m_failed = true;
+            return false;
+        }
+        return true;
+    }
+
+    // false once a read failed or the file ended inside a record
+    bool good() const
+    {
+        return !m_failed;
+    }
+
+private:
+    FILE* m_file{ nullptr };
+    std::vector<char> m_buffer{};
+    bool m_failed{ false };
+};
+
+//--------------------------------------------------------------------------------------------
+// Traversal side: routes every match to its partition file
+class SpillPartitioner
+{
+public:
+    bool open(const fs::path& dir, size_t memLimit, std::string& error)
+    {
+        // write buffers get at most half of the budget, the rest is for grouping later on
+        const size_t bufferBytes = std::clamp<size_t>(memLimit / 2 / SPILL_PARTITIONS, 4096, 1U << 20);
+
+        for (size_t i = 0; i < SPILL_PARTITIONS; ++i)
+        {
+            m_paths.emplace_back(dir / ("part-" + std::to_string(i)));
+            m_writers.emplace_back(std::make_unique<SpillWriter>());
+            if (!m_writers.back()->open(m_paths.back(), bufferBytes))
+            {
+                error = "unable to create " + m_paths.back().string();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void add(const fs::path& path, uint64_t size, uint64_t allocated)
+    {
+        const std::string pathStr = path.string();
+        const std::string name = path.filename().string();
+
+        SpillRecordHeader header{};
+        header.keyHash = ContentHasher::hash(name.data(), name.size());
+        header.size = size;
+        header.allocated = allocated;
+        header.pathLen = static_cast<uint32_t>(pathStr.size());
+        header.nameOffset = static_cast<uint32_t>(pathStr.size() - name.size());
+
+        // high bits pick the partition, the low ones still order records inside of it
+        m_writers[(header.keyHash >> 40) % SPILL_PARTITIONS]->write(header, pathStr);
+        ++m_records;
+    }
+
+    bool finish()
+    {
+        bool ok = true;
+        for (auto& writer : m_writers)
+            ok = writer->close() && ok;
+        return ok;
+    }
+
+    const std::vector<fs::path>& partitions() const { return m_paths; }
+    uint64_t records() const { return m_records; }
+
+private:
+    std::vector<std::unique_ptr<SpillWriter>> m_writers{};
+    std::vector<fs::path> m_paths{};
+    uint64_t m_records{ 0 };
+};
+
+//--------------------------------------------------------------------------------------------
+// Turns a sorted record stream into name (and size) groups of two or more
+class SpillGroupBuilder
+{
+public:
+    using GroupFn = std::function<void(PathDetailsVec&&)>;
+
+    SpillGroupBuilder(const GroupFn& onGroup, bool compareSize)
+        : m_onGroup(onGroup), m_compareSize(compareSize)
+    {
+    }
+
+    void add(const char* data)
+    {
+        const SpillRecord record(data);
+        if (!m_members.empty() && !record.sameKey(SpillRecord(m_current.data()), m_compareSize))
+            flush();
+
+        if (m_members.empty())
+            m_current.assign(data, sizeof(SpillRecordHeader) + record.path().size());
+
+        m_members.emplace_back(PathDetails{ fs::path(record.path()), record.size(), record.allocated() });
+    }
+
+    void flush()
+    {
+        if (m_members.size() > 1)
+            m_onGroup(std::move(m_members));
+        m_members.clear();
+    }
+
+private:
+    const GroupFn& m_onGroup;
+    bool m_compareSize;
+    std::string m_current{};
+    PathDetailsVec m_members{};
+};
+
+//--------------------------------------------------------------------------------------------
+// Runs merged at once. Each open run costs a read buffer and a file descriptor, so the fan-in
+// is bounded by both; more runs than that are merged in passes.
+static constexpr size_t SPILL_MAX_FAN_IN = 64;
+static constexpr size_t SPILL_MIN_RUN_BUFFER = 64 * 1024;
+
+// descriptors still free for runs, leaving some to everyone else
+static inline size_t spillOpenFileBudget()
+{
+    constexpr size_t RESERVED = 32;
+#ifdef _WIN32
+    const size_t limit = static_cast<size_t>(_getmaxstdio());
+#else
+    rlimit rl{};
+    const size_t limit = ::getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY
+                       ? static_cast<size_t>(rl.rlim_cur) : 1024;
+#endif
+    return limit > RESERVED + 3 ? limit - RESERVED : 3;
+}
+
+// k-way merge of sorted runs into onRecord, a truncated or unreadable run is an error
+template <typename RecordFn>
+static inline bool mergeSpillRuns(const std::vector<fs::path>& runs, size_t runBuffer, RecordFn&& onRecord,
+                                  std::string& error)
+{
+    std::vector<std::unique_ptr<SpillReader>> readers{};
+    std::vector<std::string> heads(runs.size());
+
+    auto headLess = [&](size_t a, size_t b) { return SpillRecord(heads[b].data()) < SpillRecord(heads[a].data()); };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(headLess)> queue(headLess);
+
+    auto advance = [&](size_t i)
+    {
+        if (readers[i]->next(heads[i]))
+        {
+            queue.push(i);
+            return true;
+        }
+        if (readers[i]->good())
+            return true;
+
+        error = "truncated or unreadable sorted run " + runs[i].string();
+        return false;
+    };
+
+    for (size_t i = 0; i < runs.size(); ++i)
+    {
+        readers.emplace_back(std::make_unique<SpillReader>());
+        if (!readers[i]->open(runs[i], runBuffer))
+        {
+            error = "unable to read " + runs[i].string();
+            return false;
+        }
+        if (!advance(i))
+            return false;
+    }
+
+    while (!queue.empty())
+    {
+        const size_t i = queue.top();
+        queue.pop();
+
+        onRecord(heads[i]);
+        if (!advance(i))
+            return false;
+    }
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------
+// Groups one partition within memLimit bytes of record data; runs that don't fit are sorted
+// and written next to the partition, then merged, in passes when there are more of them than
+// can be open at once within the budget.
+static inline bool groupSpillPartition(const fs::path& partition, size_t memLimit, bool compareSize,
+                                       const SpillGroupBuilder::GroupFn& onGroup, std::string& error)
+{
+    SpillReader reader{};
+    if (!reader.open(partition, 1U << 20))
+    {
+        error = "unable to read " + partition.string();
+        return false;
+    }
+
+    std::vector<char> arena{};
+    std::vector<size_t> offsets{};
+    std::vector<fs::path> runs{};
+    size_t runsWritten = 0;
+    std::string record{};
+
+    auto sortChunk = [&]()
+    {
+        std::sort(std::begin(offsets), std::end(offsets),
+            [&](size_t a, size_t b) { return SpillRecord(&arena[a]) < SpillRecord(&arena[b]); });
+    };
+
+    auto writeRun = [&]() -> bool
+    {
+        sortChunk();
+        runs.emplace_back(partition.string() + ".run" + std::to_string(runsWritten++));
+
+        SpillWriter run{};
+        if (!run.open(runs.back(), 1U << 20))
+            return false;
+        for (size_t off : offsets)
+            run.write(&arena[off], sizeof(SpillRecordHeader) + SpillRecord(&arena[off]).path().size());
+
+        arena.clear();
+        offsets.clear();
+        return run.close();
+    };
+
+    while (reader.next(record))
+    {
+        const size_t needed = arena.size() + record.size() + (offsets.size() + 1) * sizeof(size_t);
+        if (needed > memLimit && !offsets.empty() && !writeRun())
+        {
+            error = "unable to write sorted run for " + partition.string();
+            return false;
+        }
+
+        offsets.emplace_back(arena.size());
+        arena.insert(arena.end(), record.begin(), record.end());
+    }
+    if (!reader.good())
+    {
+        error = "truncated or unreadable partition " + partition.string();
+        return false;
+    }
+
+    SpillGroupBuilder builder(onGroup, compareSize);
+
+    if (runs.empty())
+    {
+        sortChunk();
+        for (size_t off : offsets)
+            builder.add(&arena[off]);
+        builder.flush();
+        return true;
+    }
+
+    if (!offsets.empty() && !writeRun())
+    {
+        error = "unable to write sorted run for " + partition.string();
+        return false;
+    }
+    arena.shrink_to_fit();
+    offsets.shrink_to_fit();
+
+    // every open run gets an equal share of the budget as read buffer, an intermediate pass
+    // needs one more for the run it writes
+    const size_t fanIn = std::max<size_t>(2, std::min({ SPILL_MAX_FAN_IN, std::max<size_t>(memLimit / SPILL_MIN_RUN_BUFFER, 3) - 1,
+                                                        spillOpenFileBudget() - 1 }));
+    const size_t runBuffer = memLimit / (fanIn + 1);
+
+    std::error_code ec{};
+    while (runs.size() > fanIn)
+    {
+        std::vector<fs::path> merged{};
+        for (size_t first = 0; first < runs.size(); first += fanIn)
+        {
+            const std::vector<fs::path> inputs(runs.begin() + first,
+                                               runs.begin() + std::min(first + fanIn, runs.size()));
+            merged.emplace_back(partition.string() + ".run" + std::to_string(runsWritten++));
+
+            SpillWriter out{};
+            if (!out.open(merged.back(), runBuffer))
+            {
+                error = "unable to write sorted run for " + partition.string();
+                return false;
+            }
+            if (!mergeSpillRuns(inputs, runBuffer, [&](const std::string& rec) { out.write(rec.data(), rec.size()); }, error))
+                return false;
+            if (!out.close())
+            {
+                error = "unable to write sorted run for " + partition.string();
+                return false;
+            }
+
+            for (const fs::path& input : inputs)
+                fs::remove(input, ec);
+        }
+        runs = std::move(merged);
+    }
+
+    if (!mergeSpillRuns(runs, runBuffer, [&](const std::string& rec) { builder.add(rec.data()); }, error))
+        return false;
+    builder.flush();
+
+    for (const fs::path& run : runs)
+        fs::remove(run, ec);
+    return true;
+}
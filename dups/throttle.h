@@ -0,0 +1,103 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+#ifdef __linux__
+    #include <sys/syscall.h>
+    #include <unistd.h>
+#endif
+
+#include "metrics.h"
+
+//--------------------------------------------------------------------------------------------
+// Token bucket as virtual scheduling: every request reserves its tokens by pushing the time
+// the bucket is next empty forward and sleeps until its own reservation is due. Callers are
+// served in arrival order without anyone sleeping under the lock, and a request larger than
+// the burst just waits longer instead of never fitting.
+class TokenBucket
+{
+public:
+    // tokens per second, 0 = unlimited; up to burstSecs worth may go out without waiting
+    void configure(uint64_t ratePerSec, double burstSecs = 0.1)
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_nanosPerToken.store(ratePerSec == 0 ? 0.0 : 1e9 / ratePerSec, std::memory_order_relaxed);
+        m_burstNanos = static_cast<uint64_t>(burstSecs * 1e9);
+        m_emptyAt = 0;
+    }
+
+    // checked on every I/O without the lock, hence atomic
+    bool active() const { return m_nanosPerToken.load(std::memory_order_relaxed) > 0.0; }
+
+    // nanoseconds the caller has to wait before it may use tokens
+    uint64_t reserve(uint64_t tokens)
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        const uint64_t now = nowNanos();
+        m_emptyAt = std::max(m_emptyAt, now) + static_cast<uint64_t>(tokens * m_nanosPerToken.load(std::memory_order_relaxed));
+        return m_emptyAt > now + m_burstNanos ? m_emptyAt - now - m_burstNanos : 0;
+    }
+
+private:
+    std::mutex m_lock{};
+    std::atomic<double> m_nanosPerToken{ 0.0 };
+    uint64_t m_burstNanos{ 0 };
+    uint64_t m_emptyAt{ 0 };
+};
+
+//--------------------------------------------------------------------------------------------
+// Read bandwidth and IOPS caps shared by traversal and every content reader. Each directory
+// opened, file stat'ed and read call is one operation, reads are also charged their bytes.
+// Time spent waiting is counted in g_metrics.
+class IoThrottle
+{
+public:
+    void configure(uint64_t maxReadBytesPerSec, uint64_t maxIops)
+    {
+        m_bytes.configure(maxReadBytesPerSec);
+        m_ops.configure(maxIops);
+    }
+
+    void acquire(uint64_t bytes, uint64_t ops = 1)
+    {
+        uint64_t waitNanos = 0;
+        if (m_bytes.active() && bytes != 0)
+            waitNanos = m_bytes.reserve(bytes);
+        if (m_ops.active())
+            waitNanos = std::max(waitNanos, m_ops.reserve(ops));
+
+        if (waitNanos != 0)
+        {
+            std::this_thread::sleep_for(std::chrono::nanoseconds(waitNanos));
+            g_metrics.throttleWaits.fetch_add(1, std::memory_order_relaxed);
+            g_metrics.throttleNanos.fetch_add(waitNanos, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    TokenBucket m_bytes{};
+    TokenBucket m_ops{};
+};
+
+inline IoThrottle g_ioThrottle{};
+
+//--------------------------------------------------------------------------------------------
+// Puts the calling thread into the idle I/O class, so the block layer only serves it when
+// nobody else wants the disk. Threads started afterwards inherit it. Only schedulers with
+// priority classes (bfq, cfq) honour it; false where unsupported.
+static inline bool setIdleIoPriority()
+{
+#if defined(__linux__) && defined(SYS_ioprio_set)
+    constexpr int IOPRIO_WHO_PROCESS = 1;
+    constexpr int IOPRIO_CLASS_IDLE = 3;
+    constexpr int IOPRIO_CLASS_SHIFT = 13;
+    return ::syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == 0;
+#else
+    return false;
+#endif
+}
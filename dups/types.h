@@ -0,0 +1,49 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory_resource>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+
+using PathSize = std::pair<fs::path, uint64_t>;
+using PathSizeIdx = std::pair<uint64_t, size_t>;
+using PathVec  = std::vector<fs::path>;
+// allocator aware, so grouping can put them into a phase arena (arena.h)
+using IndexVec = std::pmr::vector<size_t>;
+using PathSizeIdxVec = std::pmr::vector<PathSizeIdx>;
+
+// keys come from the map's allocator as well; C++17 has no lookup by string_view in unordered
+// maps, so lookups go through one reused key instead (NameKey::assign, pipeline.h)
+using DuplicateFilesNames = std::pmr::unordered_map<std::pmr::string, IndexVec>;
+using DuplicateFilesSizes = std::unordered_map<uint64_t, uint32_t>;
+using DuplicateFilesHash  = std::unordered_map<uint64_t, uint32_t>;
+
+using MemBuffer512  = std::array<char, 512>;
+using FileMemBuffer = std::vector<std::byte>;
+using SHA2Hash      = std::array<uint8_t, 32>;
+
+//--------------------------------------------------------------------------------------------
+struct PathDetails
+{
+    fs::path m_path{};
+    uint64_t m_size{};
+    uint64_t m_allocated{};     // bytes on disk, below m_size for sparse files
+};
+
+struct NameBasedGroup
+{
+    IndexVec m_duplicates{};
+    uint64_t m_totalSize{0U};
+    uint64_t m_hash{0U};        // content hash, 0 when contents were not compared
+};
+
+using PathDetailsVec = std::vector<PathDetails>;
+using NameBasedGroupVec = std::vector<NameBasedGroup>;
@@ -0,0 +1,788 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+    #include <errno.h>
+    #include <poll.h>
+    #include <sys/inotify.h>
+    #include <sys/socket.h>
+    #include <sys/stat.h>
+    #include <sys/un.h>
+    #include <unistd.h>
+#endif
+
+#include "content.h"
+#include "output.h"
+#include "scanner.h"
+#include "types.h"
+
+//--------------------------------------------------------------------------------------------
+// In memory duplicate index for --watch: every file by path and paths bucketed by name and
+// size. Queries copy the buckets they need, hashing and writing then happen without the index;
+// full content hashes found that way are handed back and kept until the file changes.
+class DuplicateIndex
+{
+public:
+    // members are sorted by path, hash is 0 unless contents were compared
+    using GroupFn = std::function<void(std::string_view name, uint64_t fileSize,
+                                       const std::vector<const std::string*>& members, uint64_t hash)>;
+
+    // generation tells a hash computed from a copy whether the file changed since
+    struct SnapshotFile
+    {
+        std::string path;
+        uint64_t generation;
+        uint64_t hash;
+        bool hashed;
+    };
+
+    struct Bucket
+    {
+        uint64_t fileSize;
+        std::vector<SnapshotFile> files;
+    };
+
+    void add(const std::string& path, uint64_t size)
+    {
+        remove(path);
+        m_files.emplace(path, IndexedFile{ size, ++m_generation });
+
+        std::set<std::string>& bucket = m_buckets[bucketKey(path, size)];
+        bucket.insert(path);
+        if (bucket.size() == 2)
+            ++m_groupCount;
+    }
+
+    void remove(const std::string& path)
+    {
+        auto iter = m_files.find(path);
+        if (iter == m_files.end())
+            return;
+
+        eraseFromBucket(iter->first, iter->second.size);
+        m_files.erase(iter);
+    }
+
+    // drops every file below dir, m_files being ordered makes that a single range
+    void removeTree(const std::string& dir)
+    {
+        const std::string prefix = dir + '/';
+        auto first = m_files.lower_bound(prefix);
+        auto last = first;
+        for (; last != m_files.end() && last->first.compare(0, prefix.size(), prefix) == 0; ++last)
+            eraseFromBucket(last->first, last->second.size);
+
+        m_files.erase(first, last);
+    }
+
+    void clear()
+    {
+        m_files.clear();
+        m_buckets.clear();
+        m_groupCount = 0;
+    }
+
+    size_t fileCount() const { return m_files.size(); }
+    size_t groupCount() const { return m_groupCount; }
+
+    std::vector<Bucket> snapshotGroups() const
+    {
+        std::vector<Bucket> groups{};
+        for (const auto& bucket : m_buckets)
+        {
+            if (bucket.second.size() > 1)
+                groups.emplace_back(snapshot(bucket.second));
+        }
+        return groups;
+    }
+
+    // only the group path belongs to, false if it has none
+    bool snapshotGroupOf(const std::string& path, Bucket& group) const
+    {
+        auto file = m_files.find(path);
+        if (file == m_files.end())
+            return false;
+
+        auto bucket = m_buckets.find(bucketKey(path, file->second.size));
+        if (bucket == m_buckets.end() || bucket->second.size() < 2)
+            return false;
+
+        group = snapshot(bucket->second);
+        return true;
+    }
+
+    // keeps hashes reportGroups computed, unless the file was written or replaced meanwhile
+    void storeHashes(const Bucket& group)
+    {
+        for (const SnapshotFile& copy : group.files)
+        {
+            auto file = m_files.find(copy.path);
+            if (copy.hashed && file != m_files.end() && file->second.generation == copy.generation)
+            {
+                file->second.hash = copy.hash;
+                file->second.hashed = true;
+            }
+        }
+    }
+
+    // hashes the members not hashed yet (those failing to read are left out) and reports the
+    // group, or its subgroups by content which contain mustContain
+    static void reportGroup(Bucket& group, bool verifyContent, FileMemBuffer& buffer, const std::string* mustContain,
+                            const GroupFn& onGroup)
+    {
+        const std::string_view name = fileName(group.files.front().path);
+
+        if (!verifyContent)
+        {
+            std::vector<const std::string*> members{};
+            for (const SnapshotFile& file : group.files)
+                members.emplace_back(&file.path);
+            onGroup(name, group.fileSize, members, 0);
+            return;
+        }
+
+        std::vector<std::pair<uint64_t, const std::string*>> hashed{};
+        for (SnapshotFile& file : group.files)
+        {
+            if (!file.hashed)
+            {
+                // the index doesn't keep allocated sizes, any file may have holes
+                if (!hashFile(file.path, group.fileSize, true, buffer, file.hash, g_metrics.stage(ContentStage::Full)))
+                    continue;
+                file.hashed = true;
+            }
+            hashed.emplace_back(file.hash, &file.path);
+        }
+
+        std::sort(std::begin(hashed), std::end(hashed),
+            [](const auto& one, const auto& two) { return std::tie(one.first, *one.second) < std::tie(two.first, *two.second); });
+
+        for (size_t start = 0, end = 0; start < hashed.size(); start = end)
+        {
+            bool wanted = mustContain == nullptr;
+            for (end = start; end < hashed.size() && hashed[end].first == hashed[start].first; ++end)
+                wanted = wanted || *hashed[end].second == *mustContain;
+
+            if (end - start > 1 && wanted)
+            {
+                std::vector<const std::string*> members{};
+                for (size_t i = start; i < end; ++i)
+                    members.emplace_back(hashed[i].second);
+                onGroup(name, group.fileSize, members, hashed[start].first);
+            }
+        }
+    }
+
+private:
+    struct IndexedFile
+    {
+        uint64_t size;
+        uint64_t generation;
+        uint64_t hash{ 0 };
+        bool hashed{ false };
+    };
+
+    static std::string_view fileName(std::string_view path)
+    {
+        const size_t slash = path.rfind('/');
+        return slash == std::string_view::npos ? path : path.substr(slash + 1);
+    }
+
+    // '/' never shows up in a file name, so it can separate the two
+    static std::string bucketKey(std::string_view path, uint64_t size)
+    {
+        std::string key = std::to_string(size);
+        key += '/';
+        key += fileName(path);
+        return key;
+    }
+
+    void eraseFromBucket(const std::string& path, uint64_t size)
+    {
+        auto bucket = m_buckets.find(bucketKey(path, size));
+        if (bucket == m_buckets.end())
+            return;
+
+        if (bucket->second.erase(path) != 0 && bucket->second.size() == 1)
+            --m_groupCount;
+        if (bucket->second.empty())
+            m_buckets.erase(bucket);
+    }
+
+    Bucket snapshot(const std::set<std::string>& paths) const
+    {
+        Bucket group{ m_files.at(*paths.begin()).size, {} };
+        group.files.reserve(paths.size());
+        for (const std::string& path : paths)
+        {
+            const IndexedFile& file = m_files.at(path);
+            group.files.push_back(SnapshotFile{ path, file.generation, file.hash, file.hashed });
+        }
+        return group;
+    }
+
+    std::map<std::string, IndexedFile> m_files{};
+    std::unordered_map<std::string, std::set<std::string>> m_buckets{};
+    size_t m_groupCount{ 0 };
+    uint64_t m_generation{ 0 };
+};
+
+//--------------------------------------------------------------------------------------------
+struct WatchOptions
+{
+    ScanOptions scan{};     // what is indexed: -d, patterns, --min-size, -x, --exclude-fstype, -L
+    std::string socketPath{};
+    bool verifyContent{ false };
+    OutputFormat format{ OutputFormat::Text };
+    std::function<bool(const fs::path&)> acceptName{};     // pattern and skip pattern, for events
+};
+
+inline volatile std::sig_atomic_t g_watchStop = 0;
+
+#ifdef __linux__
+
+//--------------------------------------------------------------------------------------------
+// Builds the index once, then keeps it current from inotify events and answers one request
+// per connection on a unix socket:
+//   groups        every group, in the --format given at startup
+//   dups <path>   the group <path> belongs to
+//   stats         files, groups, watched directories and walk errors as one json line
+// Directories moved within the tree are dropped and indexed again under their new name, an
+// event queue overflow rebuilds everything.
+//
+// Connections are served one after the other on a thread of their own, which only holds the
+// index lock to copy the groups it needs; hashing and a slow reader never hold up the events.
+class WatchServer
+{
+public:
+    explicit WatchServer(const WatchOptions& opts)
+        : m_opts(opts)
+    {
+    }
+
+    ~WatchServer()
+    {
+        stopClients();
+        if (m_inotify >= 0)
+            close(m_inotify);
+        if (m_listen >= 0)
+        {
+            close(m_listen);
+            unlink(m_opts.socketPath.c_str());
+        }
+    }
+
+    int run(std::ostream& log)
+    {
+        m_log = &log;
+
+        m_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (m_inotify < 0)
+        {
+            log << "inotify_init1 failed: " << std::strerror(errno) << std::endl;
+            return 1;
+        }
+
+        std::string error{};
+        if (!listenOn(error))
+        {
+            log << m_opts.socketPath << ": " << error << std::endl;
+            return 1;
+        }
+
+        std::signal(SIGINT, [](int) { g_watchStop = 1; });
+        std::signal(SIGTERM, [](int) { g_watchStop = 1; });
+        std::signal(SIGPIPE, SIG_IGN);
+
+        const uint64_t start = nowNanos();
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            indexRoots();
+        }
+        log << "Indexed " << m_index.fileCount() << " files, " << m_index.groupCount() << " groups, "
+            << m_dirWatches.size() << " directories in " << (nowNanos() - start) / 1000000 << " ms" << std::endl;
+        if (m_walkStats.numErrors != 0)
+            log << m_walkStats.numErrors << " paths could not be read, see stats" << std::endl;
+        log << "Listening on " << m_opts.socketPath << std::endl;
+
+        m_clientThread = std::thread([this]() { serveClients(); });
+
+        pollfd fds[2] = { { m_inotify, POLLIN, 0 }, { m_listen, POLLIN, 0 } };
+        while (!g_watchStop)
+        {
+            if (poll(fds, 2, 1000) < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                log << "poll failed: " << std::strerror(errno) << std::endl;
+                return 1;
+            }
+
+            if (fds[0].revents & POLLIN)
+                handleEvents();
+
+            if (fds[1].revents & POLLIN)
+            {
+                const int client = accept4(m_listen, nullptr, nullptr, SOCK_CLOEXEC);
+                if (client >= 0)
+                    queueClient(client);
+            }
+        }
+        return 0;
+    }
+
+private:
+    // IN_MODIFY catches files rewritten while kept open and truncate(2), both never closed
+    static constexpr uint32_t WATCH_MASK = IN_CREATE | IN_CLOSE_WRITE | IN_MODIFY | IN_DELETE | IN_MOVED_FROM |
+                                           IN_MOVED_TO | IN_ONLYDIR;
+
+    // connections waiting for the client thread beyond this are turned away
+    static constexpr size_t MAX_QUEUED_CLIENTS = 64;
+
+    bool listenOn(std::string& error)
+    {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (m_opts.socketPath.size() >= sizeof(addr.sun_path))
+        {
+            error = "socket path too long";
+            return false;
+        }
+        std::memcpy(addr.sun_path, m_opts.socketPath.c_str(), m_opts.socketPath.size() + 1);
+
+        m_listen = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (m_listen < 0)
+        {
+            error = std::strerror(errno);
+            return false;
+        }
+
+        // a stale socket from an earlier run would make bind fail
+        unlink(m_opts.socketPath.c_str());
+        if (bind(m_listen, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0 || listen(m_listen, 16) != 0)
+        {
+            error = std::strerror(errno);
+            close(m_listen);
+            m_listen = -1;
+            return false;
+        }
+        return true;
+    }
+
+    //----------------------------------------------------------------------------------------
+    // the index and the watch maps are only touched with m_lock held
+    void indexRoots()
+    {
+        m_roots.clear();
+        for (const fs::path& root : splitRoots(m_opts.scan.Directory))
+        {
+            std::string dir = root.string();
+            while (dir.size() > 1 && dir.back() == '/')
+                dir.pop_back();
+
+            struct stat st{};
+            m_roots.emplace_back(dir, ::stat(dir.c_str(), &st) == 0 ? static_cast<uint64_t>(st.st_dev) : 0);
+            addTree(dir);
+        }
+    }
+
+    // device of the -d root dir lies below, what -x compares against for trees moved in later
+    uint64_t rootDeviceOf(const std::string& dir) const
+    {
+        for (const auto& [root, device] : m_roots)
+        {
+            const std::string prefix = root == "/" ? root : root + '/';
+            if (dir.compare(0, prefix.size(), prefix) == 0)
+                return device;
+        }
+        return 0;
+    }
+
+    bool addWatch(const std::string& dir)
+    {
+        // with -L a watched directory may well be a link
+        const uint32_t mask = m_opts.scan.FollowSymlinks ? WATCH_MASK : WATCH_MASK | IN_DONT_FOLLOW;
+        const int wd = inotify_add_watch(m_inotify, dir.c_str(), mask);
+        if (wd < 0)
+        {
+            if (errno == ENOSPC && !m_warnedWatchLimit)
+            {
+                *m_log << "out of inotify watches, raise fs.inotify.max_user_watches" << std::endl;
+                m_warnedWatchLimit = true;
+            }
+            return false;
+        }
+
+        m_watchDirs[wd] = dir;
+        m_dirWatches[dir] = wd;
+        return true;
+    }
+
+    // walked like a scan, so -x, --exclude-fstype and -L apply and an unreadable directory is
+    // counted and skipped instead of ending the walk. Each directory is watched before it is
+    // listed, so nothing created meanwhile is missed. A directory created or moved in below a
+    // root is checked against that root's device, not its own.
+    void addTree(const std::string& dir, uint64_t rootDevice = 0)
+    {
+        WalkHooks hooks{};
+        hooks.rootDevice = rootDevice;
+        hooks.onEnterDir = [&](const fs::path& path) { addWatch(path.string()); };
+
+        forEachMatchingFile(m_opts.scan, PathVec{ fs::path(dir) }, m_walkStats,
+            [&](const fs::directory_entry& entry, uint64_t size, uint64_t)
+            {
+                m_index.add(entry.path().string(), size);
+            },
+            nullptr, true, &hooks);
+    }
+
+    void dropTree(const std::string& dir)
+    {
+        m_index.removeTree(dir);
+
+        auto dropWatch = [&](std::map<std::string, int>::iterator iter)
+        {
+            inotify_rm_watch(m_inotify, iter->second);
+            m_watchDirs.erase(iter->second);
+            return m_dirWatches.erase(iter);
+        };
+
+        auto self = m_dirWatches.find(dir);
+        if (self != m_dirWatches.end())
+            dropWatch(self);
+
+        const std::string prefix = dir + '/';
+        for (auto iter = m_dirWatches.lower_bound(prefix);
+             iter != m_dirWatches.end() && iter->first.compare(0, prefix.size(), prefix) == 0;)
+            iter = dropWatch(iter);
+    }
+
+    void addFile(const fs::path& path)
+    {
+        if (!m_opts.acceptName(path.filename()))
+            return;
+
+        std::error_code ec{};
+        const fs::file_status status = m_opts.scan.FollowSymlinks ? fs::status(path, ec) : fs::symlink_status(path, ec);
+        const uint64_t size = fs::file_size(path, ec);
+        if (ec || !fs::is_regular_file(status) || size < m_opts.scan.MinSize)
+        {
+            m_index.remove(path.string());
+            return;
+        }
+
+        m_index.add(path.string(), size);
+    }
+
+    void rescan()
+    {
+        for (const auto& watch : m_watchDirs)
+            inotify_rm_watch(m_inotify, watch.first);
+        m_watchDirs.clear();
+        m_dirWatches.clear();
+        m_index.clear();
+        indexRoots();
+        ++m_rescans;
+    }
+
+    //----------------------------------------------------------------------------------------
+    void handleEvents()
+    {
+        alignas(inotify_event) char buffer[64 * 1024];
+
+        for (;;)
+        {
+            const ssize_t len = read(m_inotify, buffer, sizeof(buffer));
+            if (len <= 0)
+                return;
+
+            std::lock_guard<std::mutex> lock(m_lock);
+            for (const char* p = buffer; p < buffer + len;)
+            {
+                const auto* event = reinterpret_cast<const inotify_event*>(p);
+                p += sizeof(inotify_event) + event->len;
+                handleEvent(*event);
+                ++m_events;
+            }
+
+            // a busy writer sends a stream of IN_MODIFY, each file is stat'ed once per batch
+            for (const std::string& path : m_modified)
+                addFile(path);
+            m_modified.clear();
+        }
+    }
+
+    void handleEvent(const inotify_event& event)
+    {
+        if (event.mask & IN_Q_OVERFLOW)
+        {
+            *m_log << "inotify queue overflowed, rescanning" << std::endl;
+            rescan();
+            return;
+        }
+
+        auto dir = m_watchDirs.find(event.wd);
+        if (dir == m_watchDirs.end())
+            return;
+
+        if (event.mask & IN_IGNORED)
+        {
+            m_dirWatches.erase(dir->second);
+            m_watchDirs.erase(dir);
+            return;
+        }
+
+        if (event.len == 0)
+            return;
+
+        const std::string path = dir->second + '/' + event.name;
+        if (event.mask & IN_ISDIR)
+        {
+            if (event.mask & (IN_CREATE | IN_MOVED_TO))
+                addTree(path, rootDeviceOf(path));
+            else if (event.mask & (IN_DELETE | IN_MOVED_FROM))
+                dropTree(path);
+        }
+        else if (event.mask & (IN_DELETE | IN_MOVED_FROM))
+        {
+            m_index.remove(path);
+        }
+        else if (event.mask & IN_MODIFY)
+        {
+            m_modified.insert(path);
+        }
+        else
+        {
+            addFile(path);
+        }
+    }
+
+    //----------------------------------------------------------------------------------------
+    void queueClient(int client)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_clientLock);
+            if (m_clients.size() < MAX_QUEUED_CLIENTS)
+            {
+                m_clients.push_back(client);
+                client = -1;
+            }
+        }
+
+        if (client >= 0)
+            close(client);
+        else
+            m_clientReady.notify_one();
+    }
+
+    void serveClients()
+    {
+        for (;;)
+        {
+            int client = -1;
+            {
+                std::unique_lock<std::mutex> lock(m_clientLock);
+                m_clientReady.wait(lock, [this]() { return m_stopClients || !m_clients.empty(); });
+                if (m_stopClients)
+                    return;
+                client = m_clients.front();
+                m_clients.pop_front();
+            }
+            handleClient(client);
+        }
+    }
+
+    void stopClients()
+    {
+        if (!m_clientThread.joinable())
+            return;
+
+        {
+            std::lock_guard<std::mutex> lock(m_clientLock);
+            m_stopClients = true;
+        }
+        m_clientReady.notify_all();
+        m_clientThread.join();
+
+        for (int client : m_clients)
+            close(client);
+        m_clients.clear();
+    }
+
+    void handleClient(int client)
+    {
+        // a client which never sends its request, or stops reading the answer, only holds up
+        // the ones queued behind it, and not for long
+        timeval timeout{ 1, 0 };
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        timeval sendTimeout{ 5, 0 };
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+
+        std::string request{};
+        char chunk[1024];
+        while (request.find('\n') == std::string::npos && request.size() < 64 * 1024)
+        {
+            const ssize_t got = recv(client, chunk, sizeof(chunk), 0);
+            if (got <= 0)
+                break;
+            request.append(chunk, static_cast<size_t>(got));
+        }
+
+        request = request.substr(0, request.find('\n'));
+        if (!request.empty() && request.back() == '\r')
+            request.pop_back();
+
+        FILE* out = fdopen(client, "w");
+        if (out == nullptr)
+        {
+            close(client);
+            return;
+        }
+
+        {
+            BufferedWriter writer(out);
+            answer(request, writer);
+        }
+        std::fclose(out);
+    }
+
+    void answer(const std::string& request, BufferedWriter& out)
+    {
+        GroupWriter groupWriter(m_opts.format, out);
+        auto writeGroup = [&](std::string_view name, uint64_t fileSize, const std::vector<const std::string*>& members,
+                              uint64_t hash)
+        {
+            groupWriter.writeGroup(name, fileSize, members.size(), fileSize * members.size(), hash,
+                                   [&](size_t i) { return std::string_view(*members[i]); });
+        };
+
+        // hashed and written from the copies, the hashes found go back into the index after
+        auto report = [&](std::vector<DuplicateIndex::Bucket>& groups, const std::string* mustContain)
+        {
+            groupWriter.writeHeader();
+            for (DuplicateIndex::Bucket& group : groups)
+            {
+                if (!out.good())
+                    break;
+                DuplicateIndex::reportGroup(group, m_opts.verifyContent, m_buffer, mustContain, writeGroup);
+            }
+
+            if (m_opts.verifyContent)
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                for (const DuplicateIndex::Bucket& group : groups)
+                    m_index.storeHashes(group);
+            }
+        };
+
+        if (request == "groups")
+        {
+            std::vector<DuplicateIndex::Bucket> groups{};
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                groups = m_index.snapshotGroups();
+            }
+            report(groups, nullptr);
+        }
+        else if (request.compare(0, 5, "dups ") == 0)
+        {
+            const std::string path = request.substr(5);
+            std::vector<DuplicateIndex::Bucket> groups(1);
+            bool found = false;
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                found = m_index.snapshotGroupOf(path, groups.front());
+            }
+            if (!found)
+                groups.clear();
+            report(groups, &path);
+        }
+        else if (request == "stats")
+        {
+            uint64_t counts[6];
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                counts[0] = m_index.fileCount();
+                counts[1] = m_index.groupCount();
+                counts[2] = m_dirWatches.size();
+                counts[3] = m_events;
+                counts[4] = m_rescans;
+                counts[5] = m_walkStats.numErrors;
+            }
+
+            const char* names[6] = { "{\"files\":", ",\"groups\":", ",\"directories\":", ",\"events\":",
+                                     ",\"rescans\":", ",\"errors\":" };
+            for (size_t i = 0; i < 6; ++i)
+            {
+                out.write(names[i]);
+                out.writeNumber(counts[i]);
+            }
+            out.write("}\n");
+        }
+        else
+        {
+            out.write("error: expected groups, dups <path> or stats\n");
+        }
+    }
+
+    const WatchOptions& m_opts;
+    std::ostream* m_log{ nullptr };
+    int m_inotify{ -1 };
+    int m_listen{ -1 };
+    bool m_warnedWatchLimit{ false };
+
+    std::mutex m_lock{};
+    DuplicateIndex m_index{};
+    std::unordered_map<int, std::string> m_watchDirs{};
+    std::map<std::string, int> m_dirWatches{};
+    std::vector<std::pair<std::string, uint64_t>> m_roots{};   // -d roots and their devices
+    std::set<std::string> m_modified{};
+    ScanStats m_walkStats{};
+    uint64_t m_events{ 0 };
+    uint64_t m_rescans{ 0 };
+
+    // the client thread's own
+    std::thread m_clientThread{};
+    std::mutex m_clientLock{};
+    std::condition_variable m_clientReady{};
+    std::deque<int> m_clients{};
+    bool m_stopClients{ false };
+    FileMemBuffer m_buffer{};
+};
+
+#else
+
+//--------------------------------------------------------------------------------------------
+class WatchServer
+{
+public:
+    explicit WatchServer(const WatchOptions&)
+    {
+    }
+
+    int run(std::ostream& log)
+    {
+        log << "--watch relies on inotify and unix sockets, it is only available on linux" << std::endl;
+        return 1;
+    }
+};
+
+#endif